@@ -0,0 +1,150 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+#include <sys/mman.h>
+
+/*
+runs every kernel converted by conv and built natively, and
+compares the two. the cost of a single crossing is measured
+with ping (64 to 32-bit and back) and pong (32 to 64-bit and
+back), and used to estimate the share of each converted run
+spent switching modes.
+*/
+
+#define SHUF_N  1000
+#define CRC_N   4096
+#define PONG_N  1000
+#define RUNS    5
+
+extern void shuffle(int *arr, int n);
+extern int ping(int x);
+extern int pong(int x, int n);
+extern unsigned crc_buf(unsigned char *buf, int len);
+
+extern void native_shuffle(int *arr, int n);
+extern int native_ping(int x);
+extern int native_pong(int x, int n);
+extern unsigned native_crc_buf(unsigned char *buf, int len);
+
+// called back by pong
+int next(int x) {
+	return x + 1;
+}
+
+int shuf_arr[SHUF_N];
+unsigned char crc_data[CRC_N];
+volatile int sink;
+
+void run_shuffle(int native) {
+	if (native)
+		native_shuffle(shuf_arr, SHUF_N);
+	else
+		shuffle(shuf_arr, SHUF_N);
+}
+
+void run_ping(int native) {
+	int i, x = 0;
+	for (i = 0; i < PONG_N; i++)
+		x = native ? native_ping(x) : ping(x);
+	sink = x;
+}
+
+void run_pong(int native) {
+	sink = native ? native_pong(0, PONG_N) : pong(0, PONG_N);
+}
+
+void run_crc(int native) {
+	sink = native ? native_crc_buf(crc_data, CRC_N) : crc_buf(crc_data, CRC_N);
+}
+
+typedef struct Kernel Kernel;
+struct Kernel {
+	char *name;
+	void (*run)(int native);
+	int iters;
+	// crossings per run, from 64-bit and from 32-bit code
+	int g2c;
+	int c2g;
+};
+
+Kernel kernels[] = {
+	{ "ping",    run_ping,    1000, PONG_N, 0 },
+	{ "pong",    run_pong,    1000, 1, PONG_N },
+	{ "shuffle", run_shuffle, 1000, 1, SHUF_N - 1 },
+	{ "crc",     run_crc,     100,  1, 0 },
+};
+
+#define KERNEL_CNT (sizeof(kernels) / sizeof(kernels[0]))
+
+double now(void) {
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1e9 + ts.tv_nsec;
+}
+
+// best time of a single run, in ns
+double measure(Kernel *k, int native) {
+	double best = 0, t;
+	int i, r;
+	for (r = 0; r < RUNS; r++) {
+		t = now();
+		for (i = 0; i < k->iters; i++)
+			k->run(native);
+		t = (now() - t) / k->iters;
+		if (!r || t < best)
+			best = t;
+	}
+	return best;
+}
+
+int real_main(void) {
+	double conv_ns[KERNEL_CNT], native_ns[KERNEL_CNT];
+	double g2c_ns, c2g_ns, cross_ns;
+	int i;
+
+	for (i = 0; i < SHUF_N; i++)
+		shuf_arr[i] = i;
+	for (i = 0; i < CRC_N; i++)
+		crc_data[i] = rand();
+
+	for (i = 0; i < KERNEL_CNT; i++) {
+		conv_ns[i] = measure(&kernels[i], 0);
+		native_ns[i] = measure(&kernels[i], 1);
+	}
+	g2c_ns = (conv_ns[0] - native_ns[0]) / PONG_N;
+	c2g_ns = (conv_ns[1] - native_ns[1] - g2c_ns) / PONG_N;
+
+	printf("crossing: 64->32 %.1f ns, 32->64 %.1f ns\n\n", g2c_ns, c2g_ns);
+	printf("%-8s %12s %12s %12s %9s %9s\n",
+		"kernel", "native ns", "conv ns", "conv runs/s", "slowdown", "crossing");
+	for (i = 0; i < KERNEL_CNT; i++) {
+		Kernel *k = &kernels[i];
+		cross_ns = k->g2c * g2c_ns + k->c2g * c2g_ns;
+		if (cross_ns > conv_ns[i])
+			cross_ns = conv_ns[i];
+		printf("%-8s %12.0f %12.0f %12.0f %8.2fx %8.1f%%\n", k->name,
+			native_ns[i], conv_ns[i], 1e9 / conv_ns[i],
+			conv_ns[i] / native_ns[i], 100 * cross_ns / conv_ns[i]);
+	}
+	return 0;
+}
+
+__asm__(
+	"call_with_stack:\n"
+	"pushq %rbp\n"
+	"movq %rsp, %rbp\n"
+	"movq %rdi, %rsp\n"
+	"call real_main\n"
+	"movq %rbp, %rsp\n"
+	"popq %rbp\n"
+	"ret\n"
+);
+
+int call_with_stack(void *ptr);
+
+int main() {
+	void *stack = mmap(0, 0x100000,
+		PROT_READ | PROT_WRITE,
+		MAP_PRIVATE | MAP_ANONYMOUS | MAP_32BIT, -1, 0);
+	return call_with_stack(stack + 0x100000);
+}
@@ -0,0 +1,13 @@
+extern int next(int x);
+
+// a 64-bit caller calling 32-bit code, nothing else
+int ping(int x) {
+	return x + 1;
+}
+
+// 32-bit code calling back into 64-bit code n times
+int pong(int x, int n) {
+	while (n--)
+		x = next(x);
+	return x;
+}
@@ -0,0 +1,18 @@
+/*
+32-bit code calling back into 64-bit code, see cbtest.c
+*/
+
+void isort(int *arr, int n, int (*cmp)(int *, int *)) {
+	int i, j, t;
+
+	for (i = 1; i < n; i++) {
+		t = arr[i];
+		for (j = i; j > 0 && cmp(&arr[j - 1], &t) > 0; j--)
+			arr[j] = arr[j - 1];
+		arr[j] = t;
+	}
+}
+
+int apply(int (*fn)(int), int x) {
+	return fn(x);
+}
@@ -0,0 +1,86 @@
+#include <stdio.h>
+#include <signal.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/wait.h>
+
+#define N 10
+
+// the thunk pool of each callback signature, see conv.c
+#define THUNK_CNT 16
+
+extern void isort(int *arr, int n, int (*cmp)(int *, int *));
+extern int apply(int (*fn)(int), int x);
+
+int up(int *a, int *b) { return *a - *b; }
+int down(int *a, int *b) { return *b - *a; }
+
+// THUNK_CNT + 1 distinct callbacks of one signature
+#define ADD(k) int add##k(int x) { return x + k; }
+ADD(0) ADD(1) ADD(2) ADD(3) ADD(4) ADD(5) ADD(6) ADD(7) ADD(8)
+ADD(9) ADD(10) ADD(11) ADD(12) ADD(13) ADD(14) ADD(15) ADD(16)
+
+int (*adds[THUNK_CNT + 1])(int) = {
+	add0, add1, add2, add3, add4, add5, add6, add7, add8,
+	add9, add10, add11, add12, add13, add14, add15, add16,
+};
+
+void sort_print(int (*cmp)(int *, int *)) {
+	int arr[N] = { 3, 7, 0, 9, 1, 8, 2, 6, 5, 4 };
+	int i;
+
+	isort(arr, N, cmp);
+	for (i = 0; i < N; i++)
+		printf("%d ", arr[i]);
+	printf("\n");
+}
+
+int real_main(void) {
+	int i, sum, status;
+	pid_t pid;
+
+	// the same callbacks again only look their thunks up
+	sort_print(up);
+	sort_print(down);
+	sort_print(up);
+
+	// fill the pool of the other signature
+	sum = 0;
+	for (i = 0; i < THUNK_CNT; i++)
+		sum += apply(adds[i], 0);
+	for (i = 0; i < THUNK_CNT; i++)
+		sum += apply(adds[i], 1);
+	printf("%d\n", sum);
+
+	// one callback too many traps
+	fflush(stdout);
+	pid = fork();
+	if (pid == 0)
+		_exit(apply(adds[THUNK_CNT], 0));
+	if (pid < 0 || waitpid(pid, &status, 0) != pid)
+		return 1;
+	printf("%s\n", WIFSIGNALED(status) && WTERMSIG(status) == SIGILL ?
+		"out of thunks" : "no trap");
+
+	return 0;
+}
+
+__asm__(
+	"call_with_stack:\n"
+	"pushq %rbp\n"
+	"movq %rsp, %rbp\n"
+	"movq %rdi, %rsp\n"
+	"call real_main\n"
+	"movq %rbp, %rsp\n"
+	"popq %rbp\n"
+	"ret\n"
+);
+
+int call_with_stack(void *ptr);
+
+int main() {
+	void *stack = mmap(0, 0x10000,
+		PROT_READ | PROT_WRITE,
+		MAP_PRIVATE | MAP_ANONYMOUS | MAP_32BIT, -1, 0);
+	return call_with_stack(stack + 0x10000);
+}
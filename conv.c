@@ -1,8 +1,15 @@
 // Author: Paweł Anikiel 2021
+#define _GNU_SOURCE
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <stdarg.h>
+#include <unistd.h>
+#include <getopt.h>
+#include <fcntl.h>
+#include <utime.h>
+#include <sys/stat.h>
+#include <zlib.h>
 #include "elf.h"
 
 
@@ -31,6 +38,25 @@ void append(Str *str, void *ptr, int size) {
 	str->size += size;
 }
 
+u32 add_str(Str *tbl, char *str) {
+	u32 idx = tbl->size;
+	append(tbl, str, strlen(str) + 1);
+	return idx;
+}
+
+u32 add_prefixed_str(Str *tbl, char *prefix, char *str) {
+	char *buf;
+	u32 idx;
+
+	// str may point into tbl itself, so copy it out first
+	buf = malloc(strlen(prefix) + strlen(str) + 1);
+	if (!buf) error("out of memory");
+	sprintf(buf, "%s%s", prefix, str);
+	idx = add_str(tbl, buf);
+	free(buf);
+	return idx;
+}
+
 int read_file(Str *str, char *name, int null_terminate) {
 	FILE *fp;
 	char *ptr;
@@ -69,11 +95,36 @@ int write_file(Str *str, char *name) {
 
 // flist handling and name lookup
 
+/*
+a pointer argument can point to an array of structs, which the
+stub copies to (and back from) a scratch buffer on the stack,
+converting between the 64 and 32-bit layout of the struct.
+*/
+#define MARSHAL_IN  1
+#define MARSHAL_OUT 2
+
+typedef struct Marshal Marshal;
+struct Marshal {
+	int strct;     // index into structs + 1, 0 if not marshalled
+	int dir;
+	int cnt;       // element count
+	int cnt_arg;   // or the argument holding it + 1
+};
+
 typedef struct Sig Sig;
 struct Sig {
+	int builtin;
 	int arg_cnt;
 	int ret_type;
 	int arg_type[6];
+	int marshal_cnt;
+	Marshal marshal[6];
+	// index into callbacks + 1, for function pointer arguments
+	int fnptr_cnt;
+	int fnptr[6];
+	// integer argument words the 32-bit side passes in registers
+	int regparm;
+	int fastcall;
 };
 
 enum {
@@ -86,6 +137,8 @@ enum {
 	TYPE_LONGLONG,
 	TYPE_ULONGLONG,
 	TYPE_PTR,
+	TYPE_FLOAT,
+	TYPE_DOUBLE,
 	TYPE_CNT,
 };
 
@@ -98,9 +151,39 @@ char *type_name[] = {
 	"longlong",
 	"ulonglong",
 	"ptr",
+	"float",
+	"double",
 };
 
 #define TYPE_ISLL(t) ((t) == TYPE_LONGLONG || (t) == TYPE_ULONGLONG)
+#define TYPE_ISFP(t) ((t) == TYPE_FLOAT || (t) == TYPE_DOUBLE)
+// the size of an argument on the 32-bit stack
+#define TYPE_SIZE32(t) (TYPE_ISLL(t) || (t) == TYPE_DOUBLE ? 8 : 4)
+
+#define MAX_FIELD_CNT 32
+
+typedef struct Struct Struct;
+struct Struct {
+	char *name;
+	int field_cnt;
+	int field_type[MAX_FIELD_CNT];
+	int off32[MAX_FIELD_CNT];
+	int off64[MAX_FIELD_CNT];
+	int size32;
+	int size64;
+	// both layouts are the same, so it can be copied in bulk
+	int same;
+};
+
+#define MAX_STRUCT_CNT 63
+
+Struct structs[MAX_STRUCT_CNT + 1];
+
+// signatures of the function pointers passed to 32-bit code
+#define MAX_CALLBACK_CNT 63
+
+Sig callbacks[MAX_CALLBACK_CNT];
+int callback_cnt;
 
 typedef struct Fn Fn;
 struct Fn {
@@ -150,49 +233,269 @@ char *next_word(char *text, char **word) {
 	return text;
 }
 
+int word_type(char *word) {
+	int i;
+	for (i = 0; i < TYPE_CNT; i++) {
+		if (strcmp(word, type_name[i]) == 0)
+			return i;
+	}
+	return TYPE_INVALID;
+}
+
 char *next_type(char *text, int *type) {
 	char *word;
+	if ((text = next_word(text, &word)))
+		*type = word_type(word);
+	return text;
+}
+
+int find_struct(char *name) {
 	int i;
-	if ((text = next_word(text, &word))) {
-		*type = TYPE_INVALID;
-		for (i = 0; i < TYPE_CNT; i++) {
-			if (strcmp(word, type_name[i]) == 0)
-				*type = i;
+	for (i = 0; structs[i].name; i++) {
+		if (strcmp(name, structs[i].name) == 0)
+			return i;
+	}
+	return -1;
+}
+
+int type_size(int type, int mode) {
+	if (TYPE_ISLL(type) || type == TYPE_DOUBLE)
+		return 8;
+	if (type == TYPE_INT || type == TYPE_UINT || type == TYPE_FLOAT)
+		return 4;
+	return mode ? 8 : 4;
+}
+
+// i386 aligns long long to 4 inside structs
+int type_align(int type, int mode) {
+	return mode ? type_size(type, mode) : 4;
+}
+
+void layout_struct(Struct *st, int mode, int *off, int *size) {
+	int i, pos = 0, align, max_align = 4;
+	for (i = 0; i < st->field_cnt; i++) {
+		align = type_align(st->field_type[i], mode);
+		if (align > max_align)
+			max_align = align;
+		pos = (pos + align - 1) & -align;
+		off[i] = pos;
+		pos += type_size(st->field_type[i], mode);
+	}
+	*size = (pos + max_align - 1) & -max_align;
+}
+
+void parse_struct(char *line, Struct *st) {
+	char *word;
+	int i, type;
+
+	if (!(line = next_word(line, &word)))
+		error("flist: expected struct name");
+	if (find_struct(word) >= 0)
+		error("flist: struct %s declared twice", word);
+	st->name = word;
+	while ((line = next_type(line, &type))) {
+		if (type == TYPE_INVALID || type == TYPE_VOID)
+			error("flist: invalid field type in struct %s", st->name);
+		if (st->field_cnt == MAX_FIELD_CNT)
+			error("flist: too many fields in struct %s", st->name);
+		st->field_type[st->field_cnt++] = type;
+	}
+	if (!st->field_cnt)
+		error("flist: empty struct %s", st->name);
+	layout_struct(st, 0, st->off32, &st->size32);
+	layout_struct(st, 1, st->off64, &st->size64);
+	st->same = st->size32 == st->size64;
+	for (i = 0; i < st->field_cnt; i++) {
+		if (st->off32[i] != st->off64[i] ||
+		type_size(st->field_type[i], 0) != type_size(st->field_type[i], 1))
+			st->same = 0;
+	}
+}
+
+// [in:|out:|inout:]ptr<name>[count], the count is a number or $arg
+int parse_marshal(char *word, Marshal *m) {
+	char *p;
+
+	m->dir = MARSHAL_IN | MARSHAL_OUT;
+	if ((p = strchr(word, ':'))) {
+		*p = 0;
+		if (strcmp(word, "in") == 0)
+			m->dir = MARSHAL_IN;
+		else if (strcmp(word, "out") == 0)
+			m->dir = MARSHAL_OUT;
+		else if (strcmp(word, "inout") != 0)
+			error("flist: invalid direction %s", word);
+		word = p + 1;
+	}
+	else if (strncmp(word, "ptr<", 4) != 0) {
+		return 0;
+	}
+	if (strncmp(word, "ptr<", 4) != 0 || !(p = strchr(word, '>')))
+		error("flist: expected ptr<struct>");
+	*p++ = 0;
+	m->strct = find_struct(word + 4) + 1;
+	if (!m->strct)
+		error("flist: unknown struct %s", word + 4);
+	m->cnt = 1;
+	if (*p == '[') {
+		if (p[1] == '$') {
+			m->cnt_arg = strtol(p + 2, &p, 10);
+			if (m->cnt_arg < 1)
+				error("flist: bad count argument");
 		}
+		else
+			m->cnt = strtol(p + 1, &p, 10);
+		if (*p++ != ']')
+			error("flist: expected ]");
 	}
-	return text;
+	if (*p)
+		error("flist: junk after ptr<%s>", word + 4);
+	return 1;
+}
+
+// regparm(N) or fastcall at the start of word, returns the rest of word or 0
+char *parse_cc(char *word, Sig *sig) {
+	char *end;
+
+	if (strncmp(word, "fastcall", 8) == 0) {
+		sig->regparm = 2;
+		sig->fastcall = 1;
+		return word + 8;
+	}
+	if (strncmp(word, "regparm(", 8) != 0)
+		return 0;
+	sig->regparm = strtol(word + 8, &end, 10);
+	if (end == word + 8 || *end != ')' || sig->regparm < 0 || sig->regparm > 3)
+		error("flist: regparm takes 0 to 3 registers");
+	return end + 1;
+}
+
+// fnptr([cc,]ret,arg...), returns the callback index
+int parse_fnptr(char *word) {
+	Sig sig = { 0 };
+	char *type, *p;
+	int i, first = 1, end = 0;
+
+	word += strlen("fnptr(");
+	if ((p = parse_cc(word, &sig))) {
+		if (*p != ',')
+			error("flist: expected , after calling convention");
+		word = p + 1;
+	}
+	while (!end) {
+		type = word;
+		word += strcspn(word, ",)");
+		if (!*word)
+			error("flist: expected )");
+		end = *word == ')';
+		*word++ = 0;
+		i = word_type(type);
+		if (i == TYPE_INVALID || (i == TYPE_VOID && !first))
+			error("flist: invalid type in fnptr");
+		if (first) {
+			sig.ret_type = i;
+		}
+		else {
+			if (sig.arg_cnt == 6)
+				error("flist: too many args in fnptr");
+			sig.arg_type[sig.arg_cnt++] = i;
+		}
+		first = 0;
+	}
+	if (*word)
+		error("flist: junk after fnptr");
+
+	for (i = 0; i < callback_cnt; i++) {
+		if (memcmp(&callbacks[i], &sig, sizeof(sig)) == 0)
+			return i;
+	}
+	if (callback_cnt == MAX_CALLBACK_CNT)
+		error("flist: too many fnptr signatures");
+	callbacks[callback_cnt] = sig;
+	return callback_cnt++;
 }
 
+int find_builtin(char *name);
+
 void parse_line(char *line, Fn *fn) {
-	char *word;
+	char *word, *cc;
 	int type;
 	int arg_cnt = 0;
+	int i;
 
 	line = next_word(line, &word);
 	fn->name = word;
 
-	if (!(line = next_type(line, &type)))
+	if (!(line = next_word(line, &word)))
 		error("flist: expected type");
+	if ((cc = parse_cc(word, &fn->sig))) {
+		if (*cc)
+			error("flist: junk after calling convention");
+		if (!(line = next_word(line, &word)))
+			error("flist: expected type");
+	}
+	if (strcmp(word, "builtin") == 0) {
+		if (cc)
+			error("flist: builtin %s takes no calling convention", fn->name);
+		fn->sig.builtin = find_builtin(fn->name) + 1;
+		if (!fn->sig.builtin)
+			error("flist: no builtin %s", fn->name);
+		if (next_word(line, &word))
+			error("flist: builtin takes no signature");
+		return;
+	}
+	type = word_type(word);
 	if (type == TYPE_INVALID)
 		error("flist: invalid type");
 	fn->sig.ret_type = type;
 
-	while ((line = next_type(line, &type))) {
-		if (type == TYPE_INVALID || type == TYPE_VOID)
-			error("flist: invalid type");
+	while ((line = next_word(line, &word))) {
 		if (arg_cnt == 6)
 			error("flist: too many args");
+		if (parse_marshal(word, &fn->sig.marshal[arg_cnt])) {
+			type = TYPE_PTR;
+			fn->sig.marshal_cnt++;
+		}
+		else if (strncmp(word, "fnptr(", 6) == 0) {
+			type = TYPE_PTR;
+			fn->sig.fnptr[arg_cnt] = parse_fnptr(word) + 1;
+			fn->sig.fnptr_cnt++;
+		}
+		else {
+			type = word_type(word);
+		}
+		if (type == TYPE_INVALID || type == TYPE_VOID)
+			error("flist: invalid type");
 		fn->sig.arg_type[arg_cnt++] = type;
 	}
 	fn->sig.arg_cnt = arg_cnt;
+
+	for (i = 0; i < arg_cnt; i++) {
+		Marshal *m = &fn->sig.marshal[i];
+		if (!m->cnt_arg)
+			continue;
+		if (m->cnt_arg > arg_cnt || fn->sig.marshal[m->cnt_arg - 1].strct ||
+		TYPE_ISLL(fn->sig.arg_type[m->cnt_arg - 1]) ||
+		TYPE_ISFP(fn->sig.arg_type[m->cnt_arg - 1]) ||
+		fn->sig.arg_type[m->cnt_arg - 1] == TYPE_PTR)
+			error("flist: %s: bad count argument $%d", fn->name, m->cnt_arg);
+	}
 }
 
 void parse_flist_file(Str *str) {
-	char *text, *line;
+	char *text, *line, *word;
 	int fn_cnt = 0;
+	int struct_cnt = 0;
 
 	text = str->ptr;
 	while ((text = next_line(text, &line))) {
+		if (strncmp(line, "struct", 6) == 0 && is_ws(line[6])) {
+			if (struct_cnt >= MAX_STRUCT_CNT)
+				error("flist: too many structs");
+			line = next_word(line, &word);
+			parse_struct(line, &structs[struct_cnt++]);
+			continue;
+		}
 		if (fn_cnt >= MAX_FN_CNT)
 			error("flist: too many functions");
 		parse_line(line, &in_fns[fn_cnt++]);
@@ -225,35 +528,212 @@ is no need for relocations apart from the necessary ones.
 
 #define MODRM(mod, reg, rm) (((mod) & 3) << 6 | ((reg) & 7) << 3 | ((rm) & 7))
 
+/*
+the stubs come with call frame information, so that debuggers and
+profilers can unwind through them. a stub runs on the same stack
+in both modes, so the cfa is always rsp plus the number of bytes
+pushed since the entry. the return address of an extern stub is
+only 4 bytes long, so it's described by an expression.
+only the 64-bit callee-saved registers are recorded.
+*/
+
+#define DW_CFA_nop            0x00
+#define DW_CFA_advance_loc1   0x02
+#define DW_CFA_advance_loc2   0x03
+#define DW_CFA_def_cfa        0x0c
+#define DW_CFA_def_cfa_register 0x0d
+#define DW_CFA_def_cfa_offset 0x0e
+#define DW_CFA_val_expression 0x16
+#define DW_CFA_advance_loc    0x40
+#define DW_CFA_offset         0x80
+
+#define DW_OP_minus           0x1c
+#define DW_OP_lit4            0x34
+#define DW_OP_deref_size      0x94
+
+#define DW_REG_BP 6
+#define DW_REG_SP 7
+#define DW_REG_RA 16
+
+// dwarf register numbers, by encoding
+u8 dw_reg[] = { 0, 2, 1, 3, 7, 6, 4, 5, 8, 9, 10, 11, 12, 13, 14, 15 };
+
+// call frame instructions of the stub being generated
+Str cfi;
+u32 cfi_loc;
+int cfi_cfa;
+// the cfa is based on rbp, so pushes don't move it
+int cfi_frame;
+
+void append_uleb(Str *str, u32 val) {
+	do {
+		u8 byte = val & 0x7f;
+		val >>= 7;
+		if (val) byte |= 0x80;
+		append(str, &byte, 1);
+	} while (val);
+}
+
+void cfi_advance(Str *str) {
+	u32 delta = str->size - cfi_loc;
+	if (!delta)
+		return;
+	if (delta < 0x40) {
+		u8 op[] = { DW_CFA_advance_loc | delta };
+		append(&cfi, op, sizeof(op));
+	}
+	else if (delta < 0x100) {
+		u8 op[] = { DW_CFA_advance_loc1, delta };
+		append(&cfi, op, sizeof(op));
+	}
+	else {
+		u8 op[] = { DW_CFA_advance_loc2, delta & 0xff, delta >> 8 };
+		append(&cfi, op, sizeof(op));
+	}
+	cfi_loc = str->size;
+}
+
+// the cie describes a 64-bit call, with an 8-byte return address
+void cfi_start(Str *str, int ra_size) {
+	cfi.size = 0;
+	cfi_loc = str->size;
+	cfi_cfa = ra_size;
+	cfi_frame = 0;
+	if (ra_size == 4) {
+		u8 op[] = {
+			DW_CFA_def_cfa_offset, 4,
+			DW_CFA_val_expression, DW_REG_RA, 4,    // ra = *(u32 *) (cfa - 4)
+			DW_OP_lit4, DW_OP_minus, DW_OP_deref_size, 4,
+		};
+		append(&cfi, op, sizeof(op));
+	}
+}
+
+// the instruction just appended pushed size bytes (or popped -size)
+void cfi_push(Str *str, int size) {
+	u8 op = DW_CFA_def_cfa_offset;
+	if (cfi_frame)
+		return;
+	cfi_advance(str);
+	cfi_cfa += size;
+	append(&cfi, &op, 1);
+	append_uleb(&cfi, cfi_cfa);
+}
+
+// the cfa is now (or no longer) based on rbp
+void cfi_set_frame(Str *str, int frame) {
+	u8 op[] = { DW_CFA_def_cfa_register, frame ? DW_REG_BP : DW_REG_SP };
+	cfi_advance(str);
+	append(&cfi, op, sizeof(op));
+	cfi_frame = frame;
+}
+
+// reg is now saved at the top of the stack
+void cfi_saved(Str *str, int reg) {
+	u8 op = DW_CFA_offset | dw_reg[reg];
+	cfi_advance(str);
+	append(&cfi, &op, 1);
+	append_uleb(&cfi, cfi_cfa / 8);
+}
+
 /*
 converts arguments between 32 and 64 bit calling
 conventions, by movs between stack and registers.
 0x89 - mov reg->mem
 0x8b - mov mem->reg
 0x63 - mov mem->reg sign extend
+floats and doubles go between the stack and xmm registers:
+0xf3/0xf2 0x0f 0x11 - movss/movsd reg->mem
+0xf3/0xf2 0x0f 0x10 - movss/movsd mem->reg
+*/
+// the argument registers of the 64-bit calling convention
+u8 cc_reg[] = { DI, SI, DX, CX, 8, 9 };
+
+// the register of an argument: integer ones and xmm ones are counted apart
+int arg_reg(Sig *sig, int idx) {
+	int i, cnt = 0;
+	for (i = 0; i < idx; i++) {
+		if (TYPE_ISFP(sig->arg_type[i]) == TYPE_ISFP(sig->arg_type[idx]))
+			cnt++;
+	}
+	return TYPE_ISFP(sig->arg_type[idx]) ? cnt : cc_reg[cnt];
+}
+
+/*
+with regparm(N), the first N words of integer arguments are passed
+in eax, edx and ecx, and with fastcall the first two in ecx and edx.
+floats stay on the stack, and once an argument doesn't fit in the
+registers left, none of the ones after it get one. fastcall puts
+long longs on the stack, but they still use up two registers.
 */
+u8 regparm_reg[] = { AX, DX, CX };
+u8 fastcall_reg[] = { CX, DX };
+
+// the register of the n-th word passed in registers
+int slot_reg32(Sig *sig, int slot) {
+	return sig->fastcall ? fastcall_reg[slot] : regparm_reg[slot];
+}
+
+// the first register word of a 32-bit argument, -1 if it's on the stack
+int arg_slot32(Sig *sig, int idx) {
+	int i, words, slot = -1, left = sig->regparm;
+	for (i = 0; i <= idx; i++) {
+		slot = -1;
+		if (TYPE_ISFP(sig->arg_type[i]))
+			continue;
+		words = TYPE_SIZE32(sig->arg_type[i]) / 4;
+		if (words <= left && !(sig->fastcall && words == 2))
+			slot = sig->regparm - left;
+		left = left > words ? left - words : 0;
+	}
+	return slot;
+}
+
+// the size of the arguments on the 32-bit stack
+int stack_args_size32(Sig *sig) {
+	int i, size = 0;
+	for (i = 0; i < sig->arg_cnt; i++) {
+		if (arg_slot32(sig, i) < 0)
+			size += TYPE_SIZE32(sig->arg_type[i]);
+	}
+	return size;
+}
+
+// only the arguments on the 32-bit stack, see ins_reg_args_to_32 for the rest
 void make_stub_conv_args(Str *str, Sig *sig, int offset, int mode) {
-	u8 cc_reg[] = { DI, SI, DX, CX, 8, 9 };
 	int i;
 
 	for (i = 0; i < sig->arg_cnt; i++) {
-		u8 mov[] = { REX, 0x89, MODRM(1, cc_reg[i], SP), 0x24, offset };
-		int mov_start = 1, mov_size = 4;
+		int reg = arg_reg(sig, i);
+		// [rsp] needs no displacement
+		int disp = offset ? 1 : 0;
+		u8 mov[] = { REX, 0x89, MODRM(disp, reg, SP), 0x24, offset };
+		int mov_start = 1, mov_size = 3 + disp;
 
+		if (arg_slot32(sig, i) >= 0)
+			continue;
+
+		if (TYPE_ISFP(sig->arg_type[i])) {
+			u8 movs[] = { sig->arg_type[i] == TYPE_FLOAT ? 0xf3 : 0xf2,
+				0x0f, mode ? 0x10 : 0x11, MODRM(disp, reg, SP), 0x24, offset };
+			append(str, movs, sizeof(movs) - 1 + disp);
+			offset += TYPE_SIZE32(sig->arg_type[i]);
+			continue;
+		}
 		if (TYPE_ISLL(sig->arg_type[i]))
-			{ mov[0] |= W; mov_start = 0; mov_size = 5; }
-		if (cc_reg[i] & 8)
-			{ mov[0] |= R; mov_start = 0; mov_size = 5; }
+			{ mov[0] |= W; mov_start = 0; mov_size = 4 + disp; }
+		if (reg & 8)
+			{ mov[0] |= R; mov_start = 0; mov_size = 4 + disp; }
 
 		if (mode) {
 			if (sig->arg_type[i] == TYPE_LONG)
-				{ mov[0] |= W; mov[1] = 0x63; mov_start = 0; mov_size = 5; }
+				{ mov[0] |= W; mov[1] = 0x63; mov_start = 0; mov_size = 4 + disp; }
 			else
 				mov[1] = 0x8b;
 		}
 
 		append(str, mov + mov_start, mov_size);
-		offset += TYPE_ISLL(sig->arg_type[i]) ? 8 : 4;
+		offset += TYPE_SIZE32(sig->arg_type[i]);
 	}
 }
 
@@ -265,6 +745,253 @@ void make_stub_conv_args_to_64(Str *str, Sig *sig, int offset) {
 	make_stub_conv_args(str, sig, offset, 1);
 }
 
+/*
+marshalled arrays. the stub keeps a frame in rbp, with two
+qwords per array: the 64-bit pointer at [rbp - 16j - 8], and the
+element count and the 32-bit scratch pointer at [rbp - 16j - 16].
+the scratch buffers are allocated below, on the (low) stack.
+the copy loops use r10 and r11 as pointers, rbx for the data,
+and eax or ecx as the counter.
+*/
+
+#define R10 10
+#define R11 11
+
+u8 stub_frame_enter[] = {
+	0x48, 0x89, 0xe5,       // mov     rbp, rsp
+};
+
+u8 stub_frame_leave[] = {
+	0x48, 0x89, 0xec,       // mov     rsp, rbp
+};
+
+u8 stub_frame_align[] = {
+	0x48, 0x83, 0xec, 0x08, // sub     rsp, 8
+};
+
+u8 stub_alloc_scratch[] = {
+	0x48, 0x29, 0xc4,       // sub     rsp, rax
+	0x48, 0x83, 0xe4, 0xf0, // and     rsp, -16
+};
+
+// the mod and displacement bytes of [base + disp], in the shortest form
+int append_disp(u8 *instr, int base, int disp) {
+	if (!disp && (base & 7) != BP)
+		return 0;
+	if (disp >= -0x80 && disp < 0x80) {
+		instr[0] = disp;
+		return 1;
+	}
+	memcpy(instr, &disp, 4);
+	return 4;
+}
+
+int disp_mod(int size) {
+	return size == 4 ? 2 : size;
+}
+
+// op reg, [base + disp] (or the other way around)
+void append_mem_op(Str *str, int rex, u8 op, int reg, int base, int disp) {
+	u8 instr[12];
+	int size = 0, disp_size, modrm;
+
+	rex |= (reg & 8 ? R : 0) | (base & 8 ? B : 0);
+	if (rex)
+		instr[size++] = REX | rex;
+	instr[size++] = op;
+	modrm = size++;
+	if ((base & 7) == SP)
+		instr[size++] = 0x24;
+	disp_size = append_disp(instr + size, base, disp);
+	instr[modrm] = MODRM(disp_mod(disp_size), reg, base);
+	append(str, instr, size + disp_size);
+}
+
+// op reg, reg
+void append_reg_op(Str *str, int rex, u8 op, int reg, int rm) {
+	u8 instr[] = { REX | rex, op, MODRM(3, reg, rm) };
+	instr[0] |= (reg & 8 ? R : 0) | (rm & 8 ? B : 0);
+	if (instr[0] == REX)
+		append(str, instr + 1, 2);
+	else
+		append(str, instr, 3);
+}
+
+// movdqu xmm15, [base + disp] (or the other way around)
+void append_movdqu(Str *str, int store, int base, int disp) {
+	u8 instr[] = { 0xf3, REX | R | B, 0x0f, store ? 0x7f : 0x6f, 0 };
+	u8 disp_bytes[4];
+	int disp_size = append_disp(disp_bytes, base, disp);
+	instr[4] = MODRM(disp_mod(disp_size), 15, base);
+	append(str, instr, sizeof(instr));
+	append(str, disp_bytes, disp_size);
+}
+
+void append_rel32(Str *str, int pos, int target) {
+	int rel = target - (pos + 4);
+	memcpy(str->ptr + pos, &rel, 4);
+}
+
+/*
+copies cnt structs from r10 to r11, converting them to 32-bit
+(mode 0) or back to 64-bit (mode 1).
+*/
+void make_stub_copy(Str *str, Struct *st, int cnt_reg, int mode) {
+	int i, jz_pos, loop_pos, off;
+	int src_size = mode ? st->size32 : st->size64;
+	int dst_size = mode ? st->size64 : st->size32;
+
+	append_reg_op(str, 0, 0x85, cnt_reg, cnt_reg);     // test    cnt, cnt
+	{
+		u8 instr[] = { 0x0f, 0x84, 0x00, 0x00, 0x00, 0x00 }; // jz      <end>
+		append(str, instr, sizeof(instr));
+		jz_pos = str->size - 4;
+	}
+	loop_pos = str->size;
+
+	if (st->same) {
+		// the layouts match, copy the whole struct
+		for (off = 0; off + 16 <= src_size; off += 16) {
+			append_movdqu(str, 0, R10, off);
+			append_movdqu(str, 1, R11, off);
+		}
+		for (; off < src_size; off += 4) {
+			int rex = off + 8 <= src_size ? W : 0;
+			append_mem_op(str, rex, 0x8b, BX, R10, off);
+			append_mem_op(str, rex, 0x89, BX, R11, off);
+			if (rex)
+				off += 4;
+		}
+	}
+	else {
+		for (i = 0; i < st->field_cnt; i++) {
+			int type = st->field_type[i];
+			int src_off = mode ? st->off32[i] : st->off64[i];
+			int dst_off = mode ? st->off64[i] : st->off32[i];
+
+			if (type_size(type, 0) == 8)
+				append_mem_op(str, W, 0x8b, BX, R10, src_off); // mov rbx, [r10 + ...]
+			else if (mode && type == TYPE_LONG)
+				append_mem_op(str, W, 0x63, BX, R10, src_off); // movsxd rbx, [r10 + ...]
+			else
+				append_mem_op(str, 0, 0x8b, BX, R10, src_off); // mov ebx, [r10 + ...]
+			append_mem_op(str, type_size(type, mode) == 8 ? W : 0,
+				0x89, BX, R11, dst_off);                      // mov [r11 + ...], (r/e)bx
+		}
+	}
+
+	{
+		u8 instr[] = { 0x49, 0x81, 0xc2, 0x00, 0x00, 0x00, 0x00 }; // add     r10, ...
+		memcpy(instr + 3, &src_size, 4);
+		append(str, instr, sizeof(instr));
+		instr[2] = 0xc3;                                         // add     r11, ...
+		memcpy(instr + 3, &dst_size, 4);
+		append(str, instr, sizeof(instr));
+	}
+	append_reg_op(str, 0, 0xff, 1, cnt_reg);           // dec     cnt
+	{
+		u8 instr[] = { 0x0f, 0x85, 0x00, 0x00, 0x00, 0x00 }; // jnz     <loop>
+		append(str, instr, sizeof(instr));
+		append_rel32(str, str->size - 4, loop_pos);
+	}
+	append_rel32(str, jz_pos, str->size);
+}
+
+// sets up the scratch buffers and replaces the pointers in the argument registers
+void make_stub_marshal_in(Str *str, Sig *sig) {
+	int i, j;
+
+	append(str, stub_frame_enter, sizeof(stub_frame_enter));
+	cfi_set_frame(str, 1);
+
+	for (i = 0; i < sig->arg_cnt; i++) {
+		Marshal *m = &sig->marshal[i];
+		int reg = arg_reg(sig, i);
+		if (!m->strct)
+			continue;
+		append_reg_op(str, 0, 0xff, 6, reg);           // push    <ptr>
+		if (m->cnt_arg) {
+			append_reg_op(str, 0, 0x89, arg_reg(sig, m->cnt_arg - 1), AX); // mov eax, <count>
+		}
+		else {
+			u8 instr[] = { 0xb8, 0x00, 0x00, 0x00, 0x00 };   // mov     eax, ...
+			memcpy(instr + 1, &m->cnt, 4);
+			append(str, instr, sizeof(instr));
+		}
+		// a null pointer has no elements
+		append_reg_op(str, W, 0x85, reg, reg);         // test    <ptr>, <ptr>
+		{
+			u8 instr[] = { 0x0f, 0x44, MODRM(3, AX, reg) }; // cmovz   eax, <ptr>
+			if (reg & 8) {
+				u8 rex = REX | B;
+				append(str, &rex, 1);
+			}
+			append(str, instr, sizeof(instr));
+		}
+		{
+			u8 instr[] = { 0x50 };                         // push    rax
+			append(str, instr, sizeof(instr));
+		}
+	}
+
+	for (i = 0, j = 0; i < sig->arg_cnt; i++) {
+		Marshal *m = &sig->marshal[i];
+		Struct *st = &structs[m->strct - 1];
+		int reg = arg_reg(sig, i);
+		int slot = -16 * j - 16;
+		if (!m->strct)
+			continue;
+		j++;
+
+		append_mem_op(str, 0, 0x8b, AX, BP, slot);     // mov     eax, <count>
+		{
+			u8 instr[] = { 0x69, 0xc0, 0x00, 0x00, 0x00, 0x00 }; // imul    eax, eax, ...
+			memcpy(instr + 2, &st->size32, 4);
+			append(str, instr, sizeof(instr));
+		}
+		append(str, stub_alloc_scratch, sizeof(stub_alloc_scratch));
+		append_mem_op(str, 0, 0x89, SP, BP, slot + 4); // mov     <scratch>, esp
+		append_reg_op(str, 0, 0x89, SP, reg);          // mov     <ptr>, esp
+		append_mem_op(str, W, 0x8b, R10, BP, slot + 8); // mov     r10, <64-bit ptr>
+		append_reg_op(str, W, 0x85, R10, R10);         // test    r10, r10
+		{
+			u8 instr[] = { REX | W | B, 0x0f, 0x44, MODRM(3, reg, R10) }; // cmovz <ptr>, r10
+			instr[0] |= reg & 8 ? R : 0;
+			append(str, instr, sizeof(instr));
+		}
+		if (m->dir & MARSHAL_IN) {
+			append_mem_op(str, 0, 0x8b, AX, BP, slot); // mov     eax, <count>
+			{
+				u8 instr[] = { 0x49, 0x89, 0xe3 };     // mov     r11, rsp
+				append(str, instr, sizeof(instr));
+			}
+			make_stub_copy(str, st, AX, 0);
+		}
+	}
+	append(str, stub_frame_align, sizeof(stub_frame_align));
+}
+
+// copies the out arrays back, and drops the frame
+void make_stub_marshal_out(Str *str, Sig *sig) {
+	int i, j;
+
+	for (i = 0, j = 0; i < sig->arg_cnt; i++) {
+		Marshal *m = &sig->marshal[i];
+		int slot = -16 * j - 16;
+		if (!m->strct)
+			continue;
+		j++;
+		if (!(m->dir & MARSHAL_OUT))
+			continue;
+		append_mem_op(str, 0, 0x8b, CX, BP, slot);      // mov     ecx, <count>
+		append_mem_op(str, 0, 0x8b, R10, BP, slot + 4); // mov     r10d, <scratch>
+		append_mem_op(str, W, 0x8b, R11, BP, slot + 8); // mov     r11, <64-bit ptr>
+		make_stub_copy(str, &structs[m->strct - 1], CX, 1);
+	}
+	append(str, stub_frame_leave, sizeof(stub_frame_leave));
+	cfi_set_frame(str, 0);
+}
+
 u8 stub_push_regs_32[] = {
 	0x57,                   // push    edi
 	0x56,                   // push    esi
@@ -297,8 +1024,75 @@ u8 stub_switch_to_64[] = {
 	0xff, 0x2c, 0x24,       // jmp far [esp]
 };
 
+/*
+the switch can also be done with a far return, or with a direct
+far jump (from 64-bit mode only through a pointer, here placed
+right after the jump). these need the absolute address of the
+end of the block, which is relocated against the stub marker.
+*/
+
+u8 stub_retf_to_32[] = {
+	0x6a, 0x23,             // push    0x23
+	0x68, 0x00, 0x00, 0x00, // push    <end of this block>
+	0x00,
+	0x48, 0xcb,             // retfq
+};
+
+u8 stub_retf_to_64[] = {
+	0x6a, 0x33,             // push    0x33
+	0x68, 0x00, 0x00, 0x00, // push    <end of this block>
+	0x00,
+	0xcb,                   // retf
+};
+
+u8 stub_far_to_32[] = {
+	0xff, 0x2d, 0x00, 0x00, // jmp far [rel <next instr>]
+	0x00, 0x00,
+	0x00, 0x00, 0x00, 0x00, // dd      <end of this block>
+	0x23, 0x00,             // dw      0x23
+};
+
+u8 stub_far_to_64[] = {
+	0xea, 0x00, 0x00, 0x00, // jmp far 0x33:<end of this block>
+	0x00, 0x33, 0x00,
+};
+
+enum {
+	SWITCH_JMP,
+	SWITCH_RETF,
+	SWITCH_FAR,
+	SWITCH_CNT,
+};
+
+char *switch_name[] = {
+	"jmp",
+	"retf",
+	"far",
+};
+
+int switch_kind;
+
+// absolute relocations into the stub being generated (the symbol is filled in later)
+Str stub_relas;
+
+void add_stub_rela(Str *str, int pos, int type) {
+	Rela64 rela;
+	rela.offset = pos;
+	rela.info = type;
+	rela.addend = str->size;
+	append(&stub_relas, &rela, sizeof(rela));
+}
+
+// a relocation against some other symbol
+void add_sym_rela(int pos, u32 sym, int type, s64 addend) {
+	Rela64 rela;
+	rela.offset = pos;
+	rela.info = R64_INFO(sym, type);
+	rela.addend = addend;
+	append(&stub_relas, &rela, sizeof(rela));
+}
+
 u8 stub_pre_call_32[] = {
-	0x83, 0xc4, 0x08,       // add     esp, 8
 	0x6a, 0x2b,             // push    0x2b
 	0x1f,                   // pop     ds
 	0x6a, 0x2b,             // push    0x2b
@@ -315,10 +1109,39 @@ u8 stub_conv_ret_to_64[] = {
 	0x48, 0x09, 0xd0,       // or      rax, rdx
 };
 
+/*
+i386 returns floats in st0, x86-64 in xmm0. the global stubs
+convert them through the (dead) argument area, the extern stubs
+through the red zone.
+*/
+
+u8 stub_conv_float_ret_to_64[] = {
+	0xd9, 0x1c, 0x24,       // fstp    dword [rsp]
+	0xf3, 0x0f, 0x10, 0x04, // movss   xmm0, [rsp]
+	0x24,
+};
+
+u8 stub_conv_double_ret_to_64[] = {
+	0xdd, 0x1c, 0x24,       // fstp    qword [rsp]
+	0xf2, 0x0f, 0x10, 0x04, // movsd   xmm0, [rsp]
+	0x24,
+};
+
+u8 stub_conv_float_ret_to_32[] = {
+	0xf3, 0x0f, 0x11, 0x44, // movss   [rsp-8], xmm0
+	0x24, 0xf8,
+	0xd9, 0x44, 0x24, 0xf8, // fld     dword [rsp-8]
+};
+
+u8 stub_conv_double_ret_to_32[] = {
+	0xf2, 0x0f, 0x11, 0x44, // movsd   [rsp-8], xmm0
+	0x24, 0xf8,
+	0xdd, 0x44, 0x24, 0xf8, // fld     qword [rsp-8]
+};
+
 u8 stub_pop_regs_32[] = {
 	0x5e,                   // pop     esi
 	0x5f,                   // pop     edi
-	0xc3,                   // ret
 };
 
 u8 stub_pop_regs_64[] = {
@@ -331,80 +1154,853 @@ u8 stub_pop_regs_64[] = {
 	0xc3,                   // ret
 };
 
-void make_stub_global(Str *str, Sig *sig, int *rel_pos) {
-	int args_size = 0;
-	int i;
-
-	for (i = 0; i < sig->arg_cnt; i++)
-		args_size += TYPE_ISLL(sig->arg_type[i]) ? 8 : 4;
-	args_size += (8 - args_size) & 0xf;
+// appends a block of pushes and pops one instruction at a time
+void append_push_pop(Str *str, u8 *code, int size, int word) {
+	int i, len, reg;
+	u8 op;
 
-	append(str, stub_push_regs_64, sizeof(stub_push_regs_64));
-	{
-		u8 instr[] = { 0x83, 0xec, args_size + 8 };    // sub     esp, ...
-		append(str, instr, sizeof(instr));
+	for (i = 0; i < size; i += len) {
+		len = (word == 8 && (code[i] & 0xf0) == REX) ? 2 : 1;
+		op = code[i + len - 1];
+		reg = (op & 7) | (len == 2 && (code[i] & B) ? 8 : 0);
+		append(str, code + i, len);
+		if ((op & 0xf8) == 0x50) {
+			cfi_push(str, word);
+			if (word == 8)
+				cfi_saved(str, reg);
+		}
+		else if ((op & 0xf8) == 0x58) {
+			cfi_push(str, -word);
+		}
 	}
-	make_stub_conv_args_to_32(str, sig, 8);
-	append(str, stub_switch_to_32, sizeof(stub_switch_to_32));
-	append(str, stub_pre_call_32, sizeof(stub_pre_call_32));
-	{
-		u8 instr[] = { 0xe8, 0x00, 0x00, 0x00, 0x00 }; // call    ??
-		*rel_pos = str->size + 1;
-		append(str, instr, sizeof(instr));
+}
+
+void make_stub_switch_to_32(Str *str) {
+	int pos = str->size;
+	switch (switch_kind) {
+		case SWITCH_JMP:
+			append(str, stub_switch_to_32, sizeof(stub_switch_to_32));
+			break;
+		case SWITCH_RETF:
+			append(str, stub_retf_to_32, 2);
+			cfi_push(str, 8);
+			append(str, stub_retf_to_32 + 2, 5);
+			cfi_push(str, 8);
+			append(str, stub_retf_to_32 + 7, 2);
+			cfi_push(str, -16);
+			add_stub_rela(str, pos + 3, R_X86_64_32S);
+			break;
+		case SWITCH_FAR:
+			append(str, stub_far_to_32, sizeof(stub_far_to_32));
+			add_stub_rela(str, pos + 6, R_X86_64_32);
+			break;
 	}
-	if (sig->ret_type != TYPE_VOID) {
-		u8 instr[] = { 0x89, 0xc1 };                   // mov     ecx, eax
-		append(str, instr, sizeof(instr));
+}
+
+// leaves switch_left() bytes of the stack used
+void make_stub_switch_to_64(Str *str) {
+	int pos = str->size;
+	switch (switch_kind) {
+		case SWITCH_JMP:
+			append(str, stub_switch_to_64, 5);
+			cfi_push(str, 4);
+			append(str, stub_switch_to_64 + 5, sizeof(stub_switch_to_64) - 5);
+			break;
+		case SWITCH_RETF:
+			append(str, stub_retf_to_64, 2);
+			cfi_push(str, 4);
+			append(str, stub_retf_to_64 + 2, 5);
+			cfi_push(str, 4);
+			append(str, stub_retf_to_64 + 7, 1);
+			cfi_push(str, -8);
+			add_stub_rela(str, pos + 3, R_X86_64_32);
+			break;
+		case SWITCH_FAR:
+			append(str, stub_far_to_64, sizeof(stub_far_to_64));
+			add_stub_rela(str, pos + 1, R_X86_64_32);
+			break;
 	}
-	append(str, stub_switch_to_64, sizeof(stub_switch_to_64));
-	if (sig->ret_type != TYPE_VOID) {
-		u8 instr[] = { 0x89, 0xc8 };                   // mov     eax, ecx
-		append(str, instr, sizeof(instr));
+}
+
+void make_stub_pre_call_32(Str *str) {
+	int i;
+	for (i = 0; i < sizeof(stub_pre_call_32); i += 3) {
+		append(str, stub_pre_call_32 + i, 2);
+		cfi_push(str, 4);
+		append(str, stub_pre_call_32 + i + 2, 1);
+		cfi_push(str, -4);
+	}
+}
+
+/*
+the stubs are first built as a list of instructions, so a peephole
+pass can clean up after the generators, which only see their own
+part of the stub. the rest of the stub (argument conversion,
+marshalling and such) is generated in place when the list is
+encoded, and only its stack offset is known to the pass.
+*/
+
+enum {
+	INS_NOP,
+	INS_BYTES,      // code, as is
+	INS_PUSH_POP,   // code made of pushes and pops, imm is the word size
+	INS_ADD_SP,     // add esp, imm (or sub, if negative)
+	INS_MOV,        // mov reg, reg2 (32-bit, or 64-bit if imm)
+	INS_MOVSXD,     // movsxd reg, reg2
+	INS_SHIFT,      // shl reg, 32 (64-bit), or shr, if imm
+	INS_OR,         // or reg, reg2 (64-bit)
+	INS_SWITCH_TO_32,
+	INS_SWITCH_TO_64,
+	INS_CALL,       // call rel32, or call [rel], if imm
+	INS_RET,        // ret imm
+	INS_GEN,        // gen(str, sig, imm)
+};
+
+typedef struct Ins Ins;
+struct Ins {
+	int op;
+	int reg, reg2;
+	int imm;
+	u8 *code;
+	int size;
+	void (*gen)(Str *str, Sig *sig, int imm);
+	Sig *sig;
+	// gen only writes above rsp + imm, so imm can follow the stack pointer
+	int sp_rel;
+	int *rel_pos;
+	// the stack the callee pops
+	int pops;
+};
+
+#define MAX_INS_CNT 32
+
+Ins ins[MAX_INS_CNT];
+int ins_cnt;
+
+Ins *add_ins(int op) {
+	if (ins_cnt == MAX_INS_CNT)
+		error("stub too long");
+	memset(&ins[ins_cnt], 0, sizeof(Ins));
+	ins[ins_cnt].op = op;
+	return &ins[ins_cnt++];
+}
+
+void ins_bytes(u8 *code, int size) {
+	Ins *in = add_ins(INS_BYTES);
+	in->code = code;
+	in->size = size;
+}
+
+void ins_push_pop(u8 *code, int size, int word) {
+	Ins *in = add_ins(INS_PUSH_POP);
+	in->code = code;
+	in->size = size;
+	in->imm = word;
+}
+
+void ins_add_sp(int imm) {
+	if (imm)
+		add_ins(INS_ADD_SP)->imm = imm;
+}
+
+Ins *ins_reg_op(int op, int reg, int reg2) {
+	Ins *in = add_ins(op);
+	in->reg = reg;
+	in->reg2 = reg2;
+	return in;
+}
+
+void ins_mov(int reg, int reg2) {
+	ins_reg_op(INS_MOV, reg, reg2);
+}
+
+void ins_mov64(int reg, int reg2) {
+	ins_reg_op(INS_MOV, reg, reg2)->imm = W;
+}
+
+void ins_movsxd(int reg, int reg2) {
+	ins_reg_op(INS_MOVSXD, reg, reg2);
+}
+
+void ins_shift(int reg, int right) {
+	ins_reg_op(INS_SHIFT, reg, 0)->imm = right;
+}
+
+void ins_or(int reg, int reg2) {
+	ins_reg_op(INS_OR, reg, reg2);
+}
+
+void ins_switch(int to_64) {
+	add_ins(to_64 ? INS_SWITCH_TO_64 : INS_SWITCH_TO_32);
+}
+
+void ins_call(int *rel_pos, int indirect, int pops) {
+	Ins *in = add_ins(INS_CALL);
+	in->rel_pos = rel_pos;
+	in->imm = indirect;
+	in->pops = pops;
+}
+
+void ins_ret(int pops) {
+	add_ins(INS_RET)->imm = pops;
+}
+
+void ins_gen(void (*gen)(Str *str, Sig *sig, int imm), Sig *sig, int imm, int sp_rel) {
+	Ins *in = add_ins(INS_GEN);
+	in->gen = gen;
+	in->sig = sig;
+	in->imm = imm;
+	in->sp_rel = sp_rel;
+}
+
+// how much of the stack the switch to 64-bit mode leaves used
+int switch_left(void) {
+	return switch_kind == SWITCH_JMP ? 4 : 0;
+}
+
+// whether the instruction changes reg
+int ins_writes(Ins *in, int reg) {
+	switch (in->op) {
+		case INS_NOP:
+		case INS_ADD_SP:
+		case INS_SWITCH_TO_64:
+			return 0;
+		case INS_SWITCH_TO_32:
+			// the far jump through the stack builds its address in ecx
+			return switch_kind == SWITCH_JMP && reg == CX;
+		case INS_MOV:
+		case INS_MOVSXD:
+		case INS_SHIFT:
+		case INS_OR:
+			return in->reg == reg;
+	}
+	return 1;
+}
+
+// whether the instruction uses the stack, not counting what it pushes and pops
+int ins_uses_sp(Ins *in) {
+	switch (in->op) {
+		case INS_NOP:
+		case INS_MOV:
+		case INS_MOVSXD:
+		case INS_SHIFT:
+		case INS_OR:
+			return 0;
+		case INS_SWITCH_TO_32:
+		case INS_SWITCH_TO_64:
+			return switch_kind == SWITCH_JMP;
+	}
+	return 1;
+}
+
+int next_ins(int i) {
+	for (i++; i < ins_cnt && ins[i].op == INS_NOP; i++);
+	return i;
+}
+
+/*
+	* mov ecx, eax; <switch>; mov eax, ecx: the switch keeps eax,
+		so only mov eax, eax is left, which clears the upper half
+		(it's undefined after coming back to 64-bit mode).
+	* mov eax, eax; movsxd rax, eax: the mov is dropped.
+	* stack adjustments only separated by instructions not using
+		the stack (like the far jump and far return switches) are
+		merged, and dropped when they cancel out.
+	* a stack adjustment right after code addressing the stack
+		relative to rsp (or only separated from it by instructions
+		not using the stack) is moved before it, into an earlier one.
+*/
+void optimize_ins(void) {
+	int i, j;
+
+	for (i = 0; i < ins_cnt; i++) {
+		if (ins[i].op != INS_MOV || ins[i].imm)
+			continue;
+		for (j = next_ins(i); j < ins_cnt; j = next_ins(j)) {
+			if (ins[j].op == INS_MOV && !ins[j].imm && ins[j].reg == ins[i].reg2 &&
+			ins[j].reg2 == ins[i].reg) {
+				ins[j].reg2 = ins[j].reg;
+				ins[i].op = INS_NOP;
+				break;
+			}
+			if (ins_writes(&ins[j], ins[i].reg) || ins_writes(&ins[j], ins[i].reg2))
+				break;
+		}
+	}
+	for (i = 0; i < ins_cnt; i++) {
+		j = next_ins(i);
+		if (ins[i].op == INS_MOV && ins[i].reg == ins[i].reg2 && j < ins_cnt &&
+		ins[j].op == INS_MOVSXD && ins[j].reg2 == ins[i].reg)
+			ins[i].op = INS_NOP;
 	}
-	if (TYPE_ISLL(sig->ret_type)) {
-		append(str, stub_conv_ret_to_64, sizeof(stub_conv_ret_to_64));
+	for (i = 0; i < ins_cnt; i++) {
+		if (ins[i].op != INS_ADD_SP)
+			continue;
+		for (j = next_ins(i); j < ins_cnt && !ins_uses_sp(&ins[j]); j = next_ins(j));
+		if (j < ins_cnt && ins[j].op == INS_ADD_SP) {
+			ins[j].imm += ins[i].imm;
+			ins[i].op = INS_NOP;
+			if (!ins[j].imm)
+				ins[j].op = INS_NOP;
+		}
+	}
+	for (i = 0; i < ins_cnt; i++) {
+		int k;
+		if (ins[i].op != INS_ADD_SP)
+			continue;
+		j = next_ins(i);
+		for (k = next_ins(j); k < ins_cnt && !ins_uses_sp(&ins[k]); k = next_ins(k));
+		if (k < ins_cnt && ins[j].op == INS_GEN && ins[j].sp_rel &&
+		ins[k].op == INS_ADD_SP && ins[k].imm < 0) {
+			ins[i].imm += ins[k].imm;
+			ins[j].imm -= ins[k].imm;
+			ins[k].op = INS_NOP;
+		}
+	}
+}
+
+void encode_ins(Str *str) {
+	int i;
+
+	for (i = 0; i < ins_cnt; i++) {
+		Ins *in = &ins[i];
+		switch (in->op) {
+			case INS_BYTES:
+				append(str, in->code, in->size);
+				break;
+			case INS_PUSH_POP:
+				append_push_pop(str, in->code, in->size, in->imm);
+				break;
+			case INS_ADD_SP: {
+				int imm = in->imm < 0 ? -in->imm : in->imm;
+				u8 op = in->imm < 0 ? 0xec : 0xc4;
+				if (imm < 0x80) {
+					u8 instr[] = { 0x83, op, imm };    // add/sub esp, imm8
+					append(str, instr, sizeof(instr));
+				}
+				else {
+					u8 instr[] = { 0x81, op };         // add/sub esp, imm32
+					append(str, instr, sizeof(instr));
+					append(str, &imm, 4);
+				}
+				cfi_push(str, -in->imm);
+				break;
+			}
+			case INS_MOV:
+				append_reg_op(str, in->imm, 0x89, in->reg2, in->reg); // mov reg, reg2
+				break;
+			case INS_MOVSXD:
+				append_reg_op(str, W, 0x63, in->reg, in->reg2); // movsxd  reg, reg2
+				break;
+			case INS_SHIFT: {
+				u8 imm = 32;
+				append_reg_op(str, W, 0xc1, in->imm ? 5 : 4, in->reg); // shl/shr reg, 32
+				append(str, &imm, 1);
+				break;
+			}
+			case INS_OR:
+				append_reg_op(str, W, 0x09, in->reg2, in->reg); // or      reg, reg2
+				break;
+			case INS_SWITCH_TO_32:
+				make_stub_switch_to_32(str);
+				break;
+			case INS_SWITCH_TO_64:
+				make_stub_switch_to_64(str);
+				break;
+			case INS_CALL:
+				if (in->imm) {
+					u8 instr[] = { 0xff, 0x15, 0x00, 0x00, 0x00, 0x00 }; // call    [rel ??]
+					*in->rel_pos = str->size + 2;
+					append(str, instr, sizeof(instr));
+				}
+				else {
+					u8 instr[] = { 0xe8, 0x00, 0x00, 0x00, 0x00 }; // call    ??
+					*in->rel_pos = str->size + 1;
+					append(str, instr, sizeof(instr));
+				}
+				// what the callee pops is gone once it returns
+				if (in->pops)
+					cfi_push(str, -in->pops);
+				break;
+			case INS_RET:
+				if (in->imm) {
+					u8 instr[] = { 0xc2, in->imm, in->imm >> 8 }; // ret     imm
+					append(str, instr, sizeof(instr));
+				}
+				else {
+					u8 instr[] = { 0xc3 };                   // ret
+					append(str, instr, sizeof(instr));
+				}
+				break;
+			case INS_GEN:
+				in->gen(str, in->sig, in->imm);
+				break;
+		}
 	}
-	else if (sig->ret_type == TYPE_LONG) {
-		u8 instr[] = { 0x48, 0x63, 0xc0 };             // movsxd  rax, eax
+	ins_cnt = 0;
+}
+
+/*
+with -t, every stub also logs the crossing. on its 64-bit side, it
+calls __conv_trace_enter before the call to the other mode and
+__conv_trace_exit after it, pushing the name of the function, which
+is stored in .rodata.conv. trace.c keeps the events in per-thread
+rings and writes them out as a chrome trace.
+*/
+
+int trace_stubs;
+// the symbol of __conv_trace_enter, __conv_trace_exit is the next one
+u32 trace_sym;
+// the names, and the local symbol at their start
+Str trace_names;
+u32 trace_names_sym;
+// the name pushes of the stub being generated, indices into stub_relas
+int trace_name_rela[2];
+int trace_name_cnt;
+
+void make_stub_trace(Str *str, int exit) {
+	if (!trace_stubs)
+		return;
+	{
+		u8 instr[] = { 0x68, 0x00, 0x00, 0x00, 0x00 }; // push    <name>
+		trace_name_rela[trace_name_cnt++] = stub_relas.size / sizeof(Rela64);
+		add_sym_rela(str->size + 1, trace_names_sym, R_X86_64_32S, 0);
 		append(str, instr, sizeof(instr));
+		cfi_push(str, 8);
 	}
 	{
-		u8 instr[] = { 0x83, 0xc4, args_size + 4 };    // add     esp, ...
+		u8 instr[] = { 0xe8, 0x00, 0x00, 0x00, 0x00 }; // call    __conv_trace_enter/exit
+		add_sym_rela(str->size + 1, trace_sym + exit, R_X86_64_PC32, -4);
 		append(str, instr, sizeof(instr));
+		cfi_push(str, -8);                             // popped by the ret 8
 	}
+}
 
-	append(str, stub_pop_regs_64, sizeof(stub_pop_regs_64));
+// adds the name pushed by make_stub_trace, dir tells which way the stub goes
+void make_stub_trace_name(char *dir, char *name) {
+	Rela64 *rela = (Rela64 *) stub_relas.ptr;
+	int i;
+	if (!trace_stubs)
+		return;
+	for (i = 0; i < trace_name_cnt; i++)
+		rela[trace_name_rela[i]].addend = trace_names.size;
+	trace_name_cnt = 0;
+	append(&trace_names, dir, strlen(dir));
+	append(&trace_names, " ", 1);
+	append(&trace_names, name, strlen(name) + 1);
 }
 
-void make_stub_extern(Str *str, Sig *sig, int *rel_pos) {
-	append(str, stub_push_regs_32, sizeof(stub_push_regs_32));
+/*
+function pointers passed to 32-bit code are replaced with thunks.
+every callback signature has a pool of THUNK_CNT thunks, which
+call the 64-bit function stored in their slot. the stub looks the
+function up in the slots, claiming a free one if it isn't there.
+slots are never freed, so a function always gets the same thunk.
+*/
+
+#define THUNK_CNT 16
+
+// where the thunks of each callback are, set up by the converter
+u32 thunk_pool[MAX_CALLBACK_CNT];
+u32 thunk_size[MAX_CALLBACK_CNT];
+// the symbols of the pools and of the slots, THUNK_CNT qwords per callback
+u32 thunk_pool_sym;
+u32 thunk_slots_sym;
+
+void make_stub_fnptr(Str *str, int reg, int cb) {
+	int done_pos, loop_pos, next_pos;
+	int found_pos[3];
+	int i;
+
+	append_reg_op(str, W, 0x85, reg, reg);             // test    <fn>, <fn>
 	{
-		u8 instr[] = { 0x83, 0xec, 0x04 };             // sub     esp, 4
+		u8 instr[] = { 0x0f, 0x84, 0x00, 0x00, 0x00, 0x00 }; // jz      <done>
 		append(str, instr, sizeof(instr));
+		done_pos = str->size - 4;
 	}
-	append(str, stub_switch_to_64, sizeof(stub_switch_to_64));
 	{
-		u8 instr[] = { 0x83, 0xc4, 0x04 };             // add     esp, 4
+		u8 instr[] = {
+			0x4c, 0x8d, 0x15, 0x00, // lea     r10, [rel <slots>]
+			0x00, 0x00, 0x00,
+			0x45, 0x31, 0xdb,       // xor     r11d, r11d
+		};
+		add_sym_rela(str->size + 3, thunk_slots_sym, R_X86_64_PC32,
+			cb * THUNK_CNT * 8 - 4);
 		append(str, instr, sizeof(instr));
 	}
-	make_stub_conv_args_to_64(str, sig, 16);
+	loop_pos = str->size;
 	{
-		u8 instr[] = { 0xe8, 0x00, 0x00, 0x00, 0x00 }; // call    ??
-		*rel_pos = str->size + 1;
+		u8 instr[] = { 0x4b, 0x8b, 0x04, 0xda };       // mov     rax, [r10 + r11*8]
 		append(str, instr, sizeof(instr));
 	}
-	if (TYPE_ISLL(sig->ret_type))
-		append(str, stub_conv_ret_to_32, sizeof(stub_conv_ret_to_32));
+	append_reg_op(str, W, 0x39, reg, AX);              // cmp     rax, <fn>
+	{
+		u8 instr[] = {
+			0x0f, 0x84, 0x00, 0x00, // je      <found>
+			0x00, 0x00,
+			0x48, 0x85, 0xc0,       // test    rax, rax
+			0x0f, 0x85, 0x00, 0x00, // jnz     <next>
+			0x00, 0x00,
+		};
+		append(str, instr, sizeof(instr));
+		found_pos[0] = str->size - 13;
+		next_pos = str->size - 4;
+	}
+	{
+		u8 instr[] = { 0xf0, REX | W | X | B, 0x0f, 0xb1, MODRM(0, reg, SP), 0xda };
+		instr[1] |= reg & 8 ? R : 0;                   // lock cmpxchg [r10 + r11*8], <fn>
+		append(str, instr, sizeof(instr));
+	}
+	{
+		u8 instr[] = { 0x0f, 0x84, 0x00, 0x00, 0x00, 0x00 }; // je      <found>
+		append(str, instr, sizeof(instr));
+		found_pos[1] = str->size - 4;
+	}
+	// someone else has claimed the slot, maybe for the same function
+	append_reg_op(str, W, 0x39, reg, AX);              // cmp     rax, <fn>
+	{
+		u8 instr[] = { 0x0f, 0x84, 0x00, 0x00, 0x00, 0x00 }; // je      <found>
+		append(str, instr, sizeof(instr));
+		found_pos[2] = str->size - 4;
+	}
+	append_rel32(str, next_pos, str->size);
 	{
-		u8 instr[] = { 0x83, 0xec, 0x04 };             // sub     esp, 4
+		u8 instr[] = {
+			0x41, 0xff, 0xc3,       // inc     r11d
+			0x41, 0x83, 0xfb,       // cmp     r11d, THUNK_CNT
+			THUNK_CNT,
+			0x0f, 0x85, 0x00, 0x00, // jne     <loop>
+			0x00, 0x00,
+			0x0f, 0x0b,             // ud2     (out of thunks)
+		};
 		append(str, instr, sizeof(instr));
+		append_rel32(str, str->size - 6, loop_pos);
 	}
-	append(str, stub_switch_to_32, sizeof(stub_switch_to_32));
+	for (i = 0; i < 3; i++)
+		append_rel32(str, found_pos[i], str->size);
 	{
-		u8 instr[] = { 0x83, 0xc4, 0x08 };             // add     esp, 4
+		u8 instr[] = {
+			0x45, 0x69, 0xdb, 0x00, // imul    r11d, r11d, <thunk size>
+			0x00, 0x00, 0x00,
+			0x8d, 0x05, 0x00, 0x00, // lea     eax, [rel <pool>]
+			0x00, 0x00,
+			0x44, 0x01, 0xd8,       // add     eax, r11d
+		};
+		memcpy(instr + 3, &thunk_size[cb], 4);
+		add_sym_rela(str->size + 9, thunk_pool_sym, R_X86_64_PC32,
+			(s64) thunk_pool[cb] - 4);
 		append(str, instr, sizeof(instr));
 	}
-	append(str, stub_pop_regs_32, sizeof(stub_pop_regs_32));
+	append_reg_op(str, 0, 0x89, AX, reg);              // mov     <fn>, eax
+	append_rel32(str, done_pos, str->size);
+}
+
+// the parts of the stubs generated in place, see encode_ins
+void gen_trace(Str *str, Sig *sig, int exit) {
+	make_stub_trace(str, exit);
+}
+
+void gen_marshal_in(Str *str, Sig *sig, int imm) {
+	make_stub_marshal_in(str, sig);
+}
+
+void gen_marshal_out(Str *str, Sig *sig, int imm) {
+	make_stub_marshal_out(str, sig);
+}
+
+void gen_fnptrs(Str *str, Sig *sig, int imm) {
+	int i;
+	for (i = 0; i < sig->arg_cnt; i++) {
+		if (sig->fnptr[i])
+			make_stub_fnptr(str, arg_reg(sig, i), sig->fnptr[i] - 1);
+	}
+}
+
+void gen_pre_call_32(Str *str, Sig *sig, int imm) {
+	make_stub_pre_call_32(str);
+}
+
+/*
+regparm and fastcall arguments go straight between the registers.
+the third 64-bit argument (rdx) can only go to ecx, and edx only
+takes the second or the first one's high word, so moving them
+backwards to 32-bit (and forwards to 64-bit) never overwrites a
+register still to be read. the jump through the stack clobbers
+ecx, so before that switch ebx stands in for it.
+*/
+int reg_before_switch(int reg) {
+	return reg == CX && switch_kind == SWITCH_JMP ? BX : reg;
+}
+
+// returns whether ecx is passed in ebx
+int ins_reg_args_to_32(Sig *sig) {
+	int i, slot, reg, in_bx = 0;
+
+	for (i = sig->arg_cnt - 1; i >= 0; i--) {
+		if ((slot = arg_slot32(sig, i)) < 0)
+			continue;
+		if (TYPE_ISLL(sig->arg_type[i])) {
+			reg = reg_before_switch(slot_reg32(sig, slot + 1));
+			ins_mov64(reg, arg_reg(sig, i));
+			ins_shift(reg, 1);
+			in_bx |= reg == BX;
+		}
+		reg = reg_before_switch(slot_reg32(sig, slot));
+		ins_mov(reg, arg_reg(sig, i));
+		in_bx |= reg == BX;
+	}
+	return in_bx;
+}
+
+void ins_reg_args_to_64(Sig *sig) {
+	int i, slot, reg;
+
+	for (i = 0; i < sig->arg_cnt; i++) {
+		if ((slot = arg_slot32(sig, i)) < 0)
+			continue;
+		reg = arg_reg(sig, i);
+		if (sig->arg_type[i] == TYPE_LONG)
+			ins_movsxd(reg, slot_reg32(sig, slot));
+		else
+			ins_mov(reg, slot_reg32(sig, slot));
+		if (TYPE_ISLL(sig->arg_type[i])) {
+			ins_shift(slot_reg32(sig, slot + 1), 0);
+			ins_or(reg, slot_reg32(sig, slot + 1));
+		}
+	}
+}
+
+void make_stub_global(Str *str, Sig *sig, char *name, int *rel_pos) {
+	int args_size = stack_args_size32(sig);
+	int pops = sig->fastcall ? args_size : 0;
+	int has_ret = sig->ret_type != TYPE_VOID && !TYPE_ISFP(sig->ret_type);
+	int in_bx;
+
+	args_size += (8 - args_size) & 0xf;
+
+	cfi_start(str, 8);
+	ins_push_pop(stub_push_regs_64, sizeof(stub_push_regs_64), 8);
+	if (trace_stubs)
+		ins_gen(gen_trace, sig, 0, 0);
+	if (sig->marshal_cnt)
+		ins_gen(gen_marshal_in, sig, 0, 0);
+	if (sig->fnptr_cnt)
+		ins_gen(gen_fnptrs, sig, 0, 0);
+	ins_add_sp(-args_size);
+	ins_gen(make_stub_conv_args_to_32, sig, 0, 1);
+	in_bx = ins_reg_args_to_32(sig);
+	// room for the far pointer of the switch, if it needs one
+	ins_add_sp(-8);
+	ins_switch(0);
+	ins_add_sp(8);
+	if (in_bx)
+		ins_mov(CX, BX);
+	ins_gen(gen_pre_call_32, sig, 0, 0);
+	ins_call(rel_pos, 0, pops);
+	// the rest of the stub still expects the argument area
+	ins_add_sp(-pops);
+	if (has_ret)
+		ins_mov(CX, AX);
+	ins_switch(1);
+	if (has_ret)
+		ins_mov(AX, CX);
+	if (sig->ret_type == TYPE_FLOAT)
+		ins_bytes(stub_conv_float_ret_to_64, sizeof(stub_conv_float_ret_to_64));
+	else if (sig->ret_type == TYPE_DOUBLE)
+		ins_bytes(stub_conv_double_ret_to_64, sizeof(stub_conv_double_ret_to_64));
+	else if (TYPE_ISLL(sig->ret_type))
+		ins_bytes(stub_conv_ret_to_64, sizeof(stub_conv_ret_to_64));
+	else if (sig->ret_type == TYPE_LONG)
+		ins_movsxd(AX, AX);
+	if (trace_stubs)
+		ins_gen(gen_trace, sig, 1, 0);
+	// the fp returns and the hook use the stack, so what the switch
+	// left on it goes only now, with the arguments
+	ins_add_sp(switch_left());
+	if (sig->marshal_cnt)
+		ins_gen(gen_marshal_out, sig, 0, 0);
+	else
+		ins_add_sp(args_size);
+	ins_push_pop(stub_pop_regs_64, sizeof(stub_pop_regs_64), 8);
+
+	optimize_ins();
+	encode_ins(str);
+	make_stub_trace_name("64->32", name);
+}
+
+void make_stub_call_64(Str *str, Sig *sig, char *name, int *rel_pos, int indirect) {
+	if (sig->marshal_cnt)
+		error("flist: arrays can only be marshalled into 32-bit code");
+	if (sig->fnptr_cnt)
+		error("flist: function pointers can only be passed to 32-bit code");
+	cfi_start(str, 4);
+	ins_push_pop(stub_push_regs_32, sizeof(stub_push_regs_32), 4);
+	ins_add_sp(-4);
+	ins_switch(1);
+	ins_add_sp(switch_left());
+	if (trace_stubs)
+		ins_gen(gen_trace, sig, 0, 0);
+	ins_reg_args_to_64(sig);
+	ins_gen(make_stub_conv_args_to_64, sig, 16, 1);
+	ins_call(rel_pos, indirect, 0);
+	if (TYPE_ISLL(sig->ret_type))
+		ins_bytes(stub_conv_ret_to_32, sizeof(stub_conv_ret_to_32));
+	else if (sig->ret_type == TYPE_FLOAT)
+		ins_bytes(stub_conv_float_ret_to_32, sizeof(stub_conv_float_ret_to_32));
+	else if (sig->ret_type == TYPE_DOUBLE)
+		ins_bytes(stub_conv_double_ret_to_32, sizeof(stub_conv_double_ret_to_32));
+	if (trace_stubs)
+		ins_gen(gen_trace, sig, 1, 0);
+	ins_add_sp(-4);
+	ins_switch(0);
+	ins_add_sp(8);
+	ins_push_pop(stub_pop_regs_32, sizeof(stub_pop_regs_32), 4);
+	ins_ret(sig->fastcall ? stack_args_size32(sig) : 0);
+
+	optimize_ins();
+	encode_ins(str);
+	make_stub_trace_name("32->64", name);
+}
+
+void make_stub_extern(Str *str, Sig *sig, char *name, int *rel_pos) {
+	make_stub_call_64(str, sig, name, rel_pos, 0);
+}
+
+void make_stub_thunk(Str *str, Sig *sig, int *rel_pos) {
+	make_stub_call_64(str, sig, "callback", rel_pos, 1);
+}
+
+
+/*
+builtins are native 32-bit implementations of some hot libc
+functions. calls to them never leave compatibility mode, so
+they need no stub at all. they only use the caller-saved
+registers (and the callee-saved ones they push), and are
+position-independent, so they can be placed anywhere in the
+stub section.
+*/
+
+u8 builtin_memcpy[] = {
+	0x57,                   // push    edi
+	0x56,                   // push    esi
+	0x8b, 0x7c, 0x24, 0x0c, // mov     edi, [esp+12]
+	0x8b, 0x74, 0x24, 0x10, // mov     esi, [esp+16]
+	0x8b, 0x4c, 0x24, 0x14, // mov     ecx, [esp+20]
+	0x89, 0xf8,             // mov     eax, edi
+	0xf3, 0xa4,             // rep     movsb
+	0x5e,                   // pop     esi
+	0x5f,                   // pop     edi
+	0xc3,                   // ret
+};
+
+u8 builtin_memset[] = {
+	0x57,                   // push    edi
+	0x8b, 0x7c, 0x24, 0x08, // mov     edi, [esp+8]
+	0x8b, 0x44, 0x24, 0x0c, // mov     eax, [esp+12]
+	0x8b, 0x4c, 0x24, 0x10, // mov     ecx, [esp+16]
+	0x89, 0xfa,             // mov     edx, edi
+	0xf3, 0xaa,             // rep     stosb
+	0x89, 0xd0,             // mov     eax, edx
+	0x5f,                   // pop     edi
+	0xc3,                   // ret
+};
+
+// scans aligned 16-byte blocks, so it never crosses a page early
+u8 builtin_strlen[] = {
+	0x8b, 0x44, 0x24, 0x04, // mov     eax, [esp+4]
+	0x89, 0xc1,             // mov     ecx, eax
+	0x83, 0xe0, 0xf0,       // and     eax, -16
+	0x83, 0xe1, 0x0f,       // and     ecx, 15
+	0x66, 0x0f, 0xef, 0xc0, // pxor    xmm0, xmm0
+	0x66, 0x0f, 0x6f, 0x08, // movdqa  xmm1, [eax]
+	0x66, 0x0f, 0x74, 0xc8, // pcmpeqb xmm1, xmm0
+	0x66, 0x0f, 0xd7, 0xd1, // pmovmskb edx, xmm1
+	0xd3, 0xea,             // shr     edx, cl
+	0x85, 0xd2,             // test    edx, edx
+	0x75, 0x1d,             // jnz     .first
+	0x83, 0xc0, 0x10,       // .loop: add eax, 16
+	0x66, 0x0f, 0x6f, 0x08, // movdqa  xmm1, [eax]
+	0x66, 0x0f, 0x74, 0xc8, // pcmpeqb xmm1, xmm0
+	0x66, 0x0f, 0xd7, 0xd1, // pmovmskb edx, xmm1
+	0x85, 0xd2,             // test    edx, edx
+	0x74, 0xed,             // jz      .loop
+	0x0f, 0xbc, 0xd2,       // bsf     edx, edx
+	0x01, 0xd0,             // add     eax, edx
+	0x2b, 0x44, 0x24, 0x04, // sub     eax, [esp+4]
+	0xc3,                   // ret
+	0x0f, 0xbc, 0xc2,       // .first: bsf eax, edx
+	0xc3,                   // ret
+};
+
+u8 builtin_memcmp[] = {
+	0x56,                   // push    esi
+	0x57,                   // push    edi
+	0x8b, 0x74, 0x24, 0x0c, // mov     esi, [esp+12]
+	0x8b, 0x7c, 0x24, 0x10, // mov     edi, [esp+16]
+	0x8b, 0x4c, 0x24, 0x14, // mov     ecx, [esp+20]
+	0x83, 0xf9, 0x10,       // .loop: cmp ecx, 16
+	0x72, 0x33,             // jb      .tail
+	0xf3, 0x0f, 0x6f, 0x06, // movdqu  xmm0, [esi]
+	0xf3, 0x0f, 0x6f, 0x0f, // movdqu  xmm1, [edi]
+	0x66, 0x0f, 0x74, 0xc1, // pcmpeqb xmm0, xmm1
+	0x66, 0x0f, 0xd7, 0xc0, // pmovmskb eax, xmm0
+	0x35, 0xff, 0xff, 0x00, // xor     eax, 0xffff
+	0x00,
+	0x75, 0x0b,             // jnz     .diff
+	0x83, 0xc6, 0x10,       // add     esi, 16
+	0x83, 0xc7, 0x10,       // add     edi, 16
+	0x83, 0xe9, 0x10,       // sub     ecx, 16
+	0xeb, 0xd9,             // jmp     .loop
+	0x0f, 0xbc, 0xc0,       // .diff: bsf eax, eax
+	0x0f, 0xb6, 0x0c, 0x06, // movzx   ecx, byte [esi+eax]
+	0x0f, 0xb6, 0x04, 0x07, // movzx   eax, byte [edi+eax]
+	0x29, 0xc1,             // sub     ecx, eax
+	0x89, 0xc8,             // mov     eax, ecx
+	0xeb, 0x15,             // jmp     .ret
+	0x85, 0xc9,             // .tail: test ecx, ecx
+	0x74, 0x0f,             // jz      .eq
+	0x0f, 0xb6, 0x06,       // .byte: movzx eax, byte [esi]
+	0x0f, 0xb6, 0x17,       // movzx   edx, byte [edi]
+	0x29, 0xd0,             // sub     eax, edx
+	0x75, 0x07,             // jnz     .ret
+	0x46,                   // inc     esi
+	0x47,                   // inc     edi
+	0x49,                   // dec     ecx
+	0x75, 0xf1,             // jnz     .byte
+	0x31, 0xc0,             // .eq: xor eax, eax
+	0x5f,                   // .ret: pop edi
+	0x5e,                   // pop     esi
+	0xc3,                   // ret
+};
+
+typedef struct Builtin Builtin;
+struct Builtin {
+	char *name;
+	u8 *code;
+	int size;
+};
+
+#define BUILTIN(name) { #name, builtin_##name, sizeof(builtin_##name) }
+
+Builtin builtins[] = {
+	BUILTIN(memcpy),
+	BUILTIN(memset),
+	BUILTIN(strlen),
+	BUILTIN(memcmp),
+	{ 0 },
+};
+
+int find_builtin(char *name) {
+	int i;
+	for (i = 0; builtins[i].name; i++) {
+		if (strcmp(name, builtins[i].name) == 0)
+			return i;
+	}
+	return -1;
+}
+
+void make_builtin(Str *str, int idx) {
+	append(str, builtins[idx].code, builtins[idx].size);
 }
 
 
@@ -413,7 +2009,9 @@ void make_stub_extern(Str *str, Sig *sig, int *rel_pos) {
 
 /* 
 these are the steps for converting the elf file:
-	* remove all the SHT_NOTE sections
+	* remove all the SHT_NOTE and .eh_frame sections, and the debug
+		and comment sections if asked to (together with their
+		relocations)
 	* for every extern symbol present in the flist file,
 		we generate a stub, make a local copy of the symbol,
 		point it to the stub, and generate a relocation
@@ -423,12 +2021,18 @@ these are the steps for converting the elf file:
 		global symbol to that stub, make a local copy of
 		the symbol, generate a relocation from the stub to
 		that local symbol, and point the local symbol to where
-		the global symbol has pointed to before.
+		the global symbol has pointed to before. we also add
+		a global __conv32_<name> symbol pointing there, so
+		64-bit code can hand the 32-bit entry to 32-bit code.
+	* every stub gets a local __conv_g2c_<name> (64 to 32)
+		or __conv_c2g_<name> (32 to 64) symbol, and an
+		.eh_frame entry describing its stack.
 	* for every relocation to a global symbol we have
 		generated a stub for, we repoint that relocation
 		to the local version of that symbol.
 	* other section headers are converted normally, and their
-		sections are copied unaltered (even string tables).
+		sections are copied unaltered (even string tables),
+		except for debug sections, which can be compressed.
 this is difficult, because all the pointers in the
 elf file change when we add and remove section headers,
 symbols, and relocation entries. to combat this, we're
@@ -441,6 +2045,14 @@ Str in_file;
 Str flist_file;
 Str out_file;
 
+// conversion options
+int strip_debug;
+int strip_comment;
+int compress_debug;
+
+// contents of .conv.sigs, see incremental conversion
+Str conv_sigs;
+
 Ehdr32 in_ehdr;
 Ehdr64 out_ehdr;
 
@@ -449,6 +2061,22 @@ Str out_shdr_tbl;
 // actual section data goes here
 Str out_sections;
 
+// the string tables grow during conversion, so they're written last
+typedef struct StrTab StrTab;
+struct StrTab {
+	u32 in_idx;
+	u16 out_idx;
+	Str strs;
+};
+
+StrTab sym_strs;
+StrTab sh_strs;
+
+// section names go here, the two tables may be the same section
+StrTab *sh_names(void) {
+	return sh_strs.in_idx == sym_strs.in_idx ? &sym_strs : &sh_strs;
+}
+
 // indices of converted section headers
 u16 *new_shdr_idx;
 // indices of the local copies of symbols
@@ -459,13 +2087,21 @@ u16 new_sym_idx_off;
 
 #define SHN_ISREAL(idx) ((idx) && (idx) < SHN_LORESERVE)
 
+// __conv32_<name>, the 32-bit entry of a function
+void conv_sym_alias(Sym32 *in_sym, Sym64 *sym, int bind, Sym64 *out_alias) {
+	*out_alias = *sym;
+	out_alias->name_idx = add_prefixed_str(&sym_strs.strs, "__conv32_",
+		sym_strs.strs.ptr + in_sym->name_idx);
+	out_alias->info = ST_INFO(bind, STT_FUNC);
+}
+
 void conv_sym_global(Sym32 *in_sym, int idx, Sig *sig, Str *stubs,
-Sym64 *out_sym, Sym64 *out_loc_sym, Rela64 *out_rela) {
+Sym64 *out_sym, Sym64 *out_loc_sym, Sym64 *out_ext_sym, Rela64 *out_rela) {
 	int stub_offset;
 	int rela_offset;
 	
 	stub_offset = stubs->size;
-	make_stub_global(stubs, sig, &rela_offset);
+	make_stub_global(stubs, sig, sym_strs.strs.ptr + in_sym->name_idx, &rela_offset);
 
 	out_loc_sym->name_idx = in_sym->name_idx;
 	out_loc_sym->info = ST_INFO(STB_LOCAL, STT_FUNC);
@@ -484,15 +2120,20 @@ Sym64 *out_sym, Sym64 *out_loc_sym, Rela64 *out_rela) {
 	out_sym->shdr_idx = out_shdr_tbl.size / sizeof(Shdr64);
 	out_sym->val = stub_offset;
 	out_sym->size = stubs->size - stub_offset;
+
+	conv_sym_alias(in_sym, out_loc_sym, STB_GLOBAL, out_ext_sym);
 }
 
-void conv_sym_extern(Sym32 *in_sym, int idx, Sig *sig, Str *stubs,
+int conv_sym_extern(Sym32 *in_sym, int idx, Sig *sig, Str *stubs,
 Sym64 *out_sym, Sym64 *out_loc_sym, Rela64 *out_rela) {
 	int stub_offset;
 	int rela_offset;
 
 	stub_offset = stubs->size;
-	make_stub_extern(stubs, sig, &rela_offset);
+	if (sig->builtin)
+		make_builtin(stubs, sig->builtin - 1);
+	else
+		make_stub_extern(stubs, sig, sym_strs.strs.ptr + in_sym->name_idx, &rela_offset);
 
 	out_loc_sym->name_idx = in_sym->name_idx;
 	out_loc_sym->info = ST_INFO(STB_LOCAL, STT_FUNC);
@@ -501,19 +2142,31 @@ Sym64 *out_sym, Sym64 *out_loc_sym, Rela64 *out_rela) {
 	out_loc_sym->val = stub_offset;
 	out_loc_sym->size = stubs->size - stub_offset;
 
-	out_rela->offset = rela_offset;
-	out_rela->info = R64_INFO(idx + new_sym_idx_off, R_X86_64_PC32);
-	out_rela->addend = -4;
-
+	// builtins don't need the 64-bit function, so don't insist on it
 	out_sym->name_idx = in_sym->name_idx;
-	out_sym->info = ST_INFO(STB_GLOBAL, STT_FUNC);
+	out_sym->info = ST_INFO(sig->builtin ? STB_WEAK : STB_GLOBAL, STT_FUNC);
 	out_sym->other = 0;
 	out_sym->shdr_idx = 0;
 	out_sym->val = 0;
 	out_sym->size = 0;
+
+	if (sig->builtin)
+		return 0;
+	out_rela->offset = rela_offset;
+	out_rela->info = R64_INFO(idx + new_sym_idx_off, R_X86_64_PC32);
+	out_rela->addend = -4;
+	return 1;
 }
 
 void conv_sym_other(Sym32 *in_sym, Sym64 *out_sym) {
+	if (SHN_ISREAL(in_sym->shdr_idx) && !new_shdr_idx[in_sym->shdr_idx]) {
+		// the section was dropped, leave an empty symbol in its place
+		memset(out_sym, 0, sizeof(*out_sym));
+		out_sym->info = ST_INFO(ST_BIND(in_sym->info), 0);
+		if (ST_BIND(in_sym->info) != STB_LOCAL)
+			out_sym->name_idx = in_sym->name_idx;
+		return;
+	}
 	out_sym->name_idx = in_sym->name_idx;
 	out_sym->info = in_sym->info;
 	out_sym->other = 0;
@@ -525,51 +2178,412 @@ void conv_sym_other(Sym32 *in_sym, Sym64 *out_sym) {
 	out_sym->size = in_sym->size;
 }
 
-void conv_symtab(Shdr32 *in_shdr, Shdr64 *out_shdr) {
-	int i, cnt;
-	char *in_shdr_tbl;
-	char *in_sym_tbl;
-	char *in_str_tbl;
-	Str stubs = { 0 };
-	Str sym_tbl = { 0 };
-	Str loc_sym_tbl = { 0 };
-	Str rela_tbl = { 0 };
-	
-	cnt = in_shdr->size / sizeof(Sym32);
-	if (copied_sym_idx)
-		error("multiple symbol tables");
-	copied_sym_idx = calloc(cnt, sizeof(u16));
-	if (!copied_sym_idx)
-		error("out of memory");
-	copied_sym_idx_cnt = cnt;
+void conv_stub_marker(char *prefix, Sym32 *in_sym, Sym64 *stub_sym, Sym64 *out_marker) {
+	*out_marker = *stub_sym;
+	out_marker->name_idx = add_prefixed_str(&sym_strs.strs, prefix,
+		sym_strs.strs.ptr + in_sym->name_idx);
+	out_marker->info = ST_INFO(STB_LOCAL, STT_FUNC);
+}
 
-	in_shdr_tbl = in_file.ptr + in_ehdr.shdr_pos;
-	in_sym_tbl = in_file.ptr + in_shdr->pos;
+void append_cie(Str *eh_frame) {
+	u8 cie[] = {
+		0x14, 0x00, 0x00, 0x00, // length
+		0x00, 0x00, 0x00, 0x00, // cie id
+		0x01,                   // version
+		'z', 'R', 0x00,         // augmentation
+		0x01,                   // code alignment factor
+		0x78,                   // data alignment factor (-8)
+		DW_REG_RA,              // return address column
+		0x01,                   // augmentation data length
+		0x1b,                   // fde pointers are pc-relative sdata4
+		DW_CFA_def_cfa, DW_REG_SP, 0x08,
+		DW_CFA_offset | DW_REG_RA, 0x01,
+		DW_CFA_nop, DW_CFA_nop,
+	};
+	append(eh_frame, cie, sizeof(cie));
+}
+
+// describes the stub just generated, starting at the symbol sym_idx (plus offset)
+void append_fde(Str *eh_frame, Str *eh_rela, u32 sym_idx, u32 offset, u32 size) {
+	u32 pos = eh_frame->size;
+	u32 len = 13 + cfi.size;
+	u32 pad = -(len + 4) & 7;
+	u8 nop = DW_CFA_nop;
+	u8 aug_len = 0;
+
+	len += pad;
 	{
-		Shdr32 shdr;
-		memcpy(&shdr, in_shdr_tbl + in_shdr->link * sizeof(shdr), sizeof(shdr));
-		in_str_tbl = in_file.ptr + shdr.pos;
+		u32 fields[] = { len, pos + 4, 0, size };
+		append(eh_frame, fields, sizeof(fields));
 	}
-
+	append(eh_frame, &aug_len, 1);
+	append(eh_frame, cfi.ptr, cfi.size);
+	while (pad--)
+		append(eh_frame, &nop, 1);
 	{
-		Sym64 sym = { 0 };
-		append(&loc_sym_tbl, &sym, sizeof(sym));
+		Rela64 rela;
+		rela.offset = pos + 8;
+		rela.info = R64_INFO(sym_idx, R_X86_64_PC32);
+		rela.addend = offset;
+		append(eh_rela, &rela, sizeof(rela));
 	}
-	new_sym_idx_off = 1;
+}
 
-	// first, count how many symbols we'll have to generate stubs for
-	for (i = 0; i < cnt; i++) {
-		Sym32 in_sym;
-		char *name;
+// relocates the absolute references of the stub just generated against its marker
+void add_marker_relas(Str *rela_tbl, u32 marker_idx, u32 stub_offset) {
+	Rela64 *rela = (Rela64 *) stub_relas.ptr;
+	int i;
+
+	for (i = 0; i < stub_relas.size / sizeof(Rela64); i++) {
+		if (R64_SYM(rela[i].info))
+			continue;
+		rela[i].info = R64_INFO(marker_idx, rela[i].info);
+		rela[i].addend -= stub_offset;
+	}
+	append(rela_tbl, stub_relas.ptr, stub_relas.size);
+	stub_relas.size = 0;
+}
+
+// the thunk pools go first in the stub section, see make_stub_fnptr
+void make_thunks(Str *stubs, Str *rela_tbl, Str *eh_frame, Str *eh_rela_tbl, u32 thunk_sym) {
+	int i, j, pos, rel_pos;
+
+	for (i = 0; i < callback_cnt; i++) {
+		thunk_pool[i] = stubs->size;
+		for (j = 0; j < THUNK_CNT; j++) {
+			pos = stubs->size;
+			make_stub_thunk(stubs, &callbacks[i], &rel_pos);
+			add_sym_rela(rel_pos, thunk_slots_sym, R_X86_64_PC32,
+				(i * THUNK_CNT + j) * 8 - 4);
+			add_marker_relas(rela_tbl, thunk_sym, 0);
+			append_fde(eh_frame, eh_rela_tbl, thunk_sym, pos, stubs->size - pos);
+		}
+		thunk_size[i] = (stubs->size - thunk_pool[i]) / THUNK_CNT;
+	}
+}
+
+void add_local_sym(Str *sym_tbl, char *name, int type, u16 shdr_idx, u64 size) {
+	Sym64 sym;
+	sym.name_idx = add_str(&sym_strs.strs, name);
+	sym.info = ST_INFO(STB_LOCAL, type);
+	sym.other = 0;
+	sym.shdr_idx = shdr_idx;
+	sym.val = 0;
+	sym.size = size;
+	append(sym_tbl, &sym, sizeof(sym));
+}
+
+void add_extern_sym(Str *sym_tbl, char *name) {
+	Sym64 sym;
+	sym.name_idx = add_str(&sym_strs.strs, name);
+	sym.info = ST_INFO(STB_GLOBAL, STT_FUNC);
+	sym.other = 0;
+	sym.shdr_idx = 0;
+	sym.val = 0;
+	sym.size = 0;
+	append(sym_tbl, &sym, sizeof(sym));
+}
+
+/*
+with -f, every stub goes in a section of its own, .text.conv.<name>
+(the thunks share one), so the linker can drop the stubs nobody
+calls with --gc-sections, and fold identical ones. the stubs are
+generated together as usual, and cut into pieces at the end.
+*/
+
+int split_stubs;
+
+typedef struct StubPiece StubPiece;
+struct StubPiece {
+	u32 start;
+	u32 name_idx;   // into sym_strs, or -1 for the thunks
+};
+
+Str stub_pieces;
+
+void add_stub_piece(u32 start, u32 name_idx) {
+	StubPiece piece = { start, name_idx };
+	append(&stub_pieces, &piece, sizeof(piece));
+}
+
+int stub_piece_cnt(void) {
+	return split_stubs ? stub_pieces.size / sizeof(StubPiece) : 1;
+}
+
+// the piece containing offset
+int find_stub_piece(u32 offset) {
+	StubPiece *piece = (StubPiece *) stub_pieces.ptr;
+	int i;
+	for (i = stub_piece_cnt() - 1; i > 0; i--) {
+		if (piece[i].start <= offset)
+			break;
+	}
+	return i;
+}
+
+// moves the symbols in the stub section to the section of their piece
+void split_stub_syms(Str *sym_tbl, u16 stub_idx) {
+	Sym64 *sym = (Sym64 *) sym_tbl->ptr;
+	StubPiece *piece = (StubPiece *) stub_pieces.ptr;
+	int i, j;
+	for (i = 0; i < sym_tbl->size / sizeof(Sym64); i++) {
+		if (sym[i].shdr_idx != stub_idx)
+			continue;
+		j = find_stub_piece(sym[i].val);
+		sym[i].shdr_idx = stub_idx + j;
+		sym[i].val -= piece[j].start;
+	}
+}
+
+char *stub_piece_name(char *prefix, int i) {
+	StubPiece *piece = (StubPiece *) stub_pieces.ptr + i;
+	char *name = piece->name_idx == -1 ? "__conv_thunks" :
+		sym_strs.strs.ptr + piece->name_idx;
+	char *buf = malloc(strlen(prefix) + strlen(name) + 1);
+	if (!buf) error("out of memory");
+	sprintf(buf, "%s%s", prefix, name);
+	return buf;
+}
+
+// appends the relocations of the stub section in piece i
+void split_stub_relas(Str *out, Str *rela_tbl, int i) {
+	Rela64 *rela = (Rela64 *) rela_tbl->ptr;
+	StubPiece *piece = (StubPiece *) stub_pieces.ptr;
+	int j;
+	for (j = 0; j < rela_tbl->size / sizeof(Rela64); j++) {
+		Rela64 r = rela[j];
+		if (find_stub_piece(r.offset) != i)
+			continue;
+		r.offset -= piece[i].start;
+		append(out, &r, sizeof(r));
+	}
+}
+
+// appends the header of a section generated by us, returns its index
+u16 add_section(char *name, u32 type, u64 flags, Str *data, u32 info, u64 align, u64 ent_size) {
+	Shdr64 shdr;
+	u16 idx = out_shdr_tbl.size / sizeof(Shdr64);
+
+	shdr.name_idx = name ? add_str(&sh_names()->strs, name) : 0;
+	shdr.type = type;
+	shdr.flags = flags;
+	shdr.addr = 0;
+	shdr.pos = sizeof(Ehdr64) + out_sections.size;
+	shdr.size = data->size;
+	shdr.link = 0;
+	shdr.info = info;
+	shdr.align = align;
+	shdr.ent_size = ent_size;
+	append(&out_shdr_tbl, &shdr, sizeof(shdr));
+	append(&out_sections, data->ptr, data->size);
+	return idx;
+}
+
+// the output index of an input symbol, once the symbol table is converted
+u32 sym_idx_to_64(u32 sym) {
+	if (sym >= copied_sym_idx_cnt)
+		error("index out of range");
+	if (copied_sym_idx[sym])
+		return copied_sym_idx[sym];
+	return sym + new_sym_idx_off;
+}
+
+/*
+pic code finds its data relative to the got, whose address it
+computes from its own (R_386_GOTPC), and loads the addresses of
+globals from got entries (R_386_GOT32, or GOT32X when the load
+could be relaxed). the converted code is linked statically below
+4G, so conv puts the got at address 0: the got register becomes
+0, GOTOFF offsets become plain addresses, and the loads become
+immediates (mov foo@GOT(%ebx), %eax is now mov $foo, %eax), and
+calls and jumps through the got direct ones. the few other
+accesses still read a got entry, from a small local got.
+*/
+Str got_ents;  // the input symbol of each local got entry
+int got_base_used;
+u32 got_sym;
+u32 got_base_sym;
+
+u32 got_entry(u32 sym) {
+	u32 *ent = (u32 *) got_ents.ptr;
+	int i, cnt = got_ents.size / 4;
+	for (i = 0; i < cnt; i++) {
+		if (ent[i] == sym)
+			return i;
+	}
+	append(&got_ents, &sym, 4);
+	return cnt;
+}
+
+// rewrites the instruction loading from the got entry at rel->offset
+int relax_got_load(u8 *code, u32 size, Rel32 *rel) {
+	u32 pos = rel->offset, sym = R32_SYM(rel->info);
+	int checked = R32_TYPE(rel->info) == R_386_GOT32X;
+	int addend;
+	u8 op, modrm, reg;
+
+	if (pos < 2 || size < 4 || pos > size - 4)
+		return 0;
+	memcpy(&addend, code + pos, 4);
+	op = code[pos - 2];
+	modrm = code[pos - 1];
+	reg = modrm >> 3 & 7;
+	// only foo@GOT(%reg) and foo@GOT, without a sib byte
+	if (addend || (!(modrm >> 6 == 2 && (modrm & 7) != 4) &&
+	!(modrm >> 6 == 0 && (modrm & 7) == 5)))
+		return 0;
+
+	if (op == 0x8b) {
+		code[pos - 2] = 0xc7;  // mov reg, imm32
+		code[pos - 1] = 0xc0 | reg;
+	}
+	// the assembler emits GOT32X only for the ones below
+	else if (checked && (op & 0xc7) == 0x03 && op < 0x40) {
+		code[pos - 2] = 0x81;  // add/or/adc/sbb/and/sub/xor/cmp reg, imm32
+		code[pos - 1] = 0xc0 | (op & 0x38) | reg;
+	}
+	else if (checked && op == 0x85) {
+		code[pos - 2] = 0xf7;  // test reg, imm32
+		code[pos - 1] = 0xc0 | reg;
+	}
+	else if (checked && op == 0xff && (reg == 2 || reg == 4)) {
+		code[pos - 2] = 0x67;  // a prefix doing nothing here, as ld pads it
+		code[pos - 1] = reg == 2 ? 0xe8 : 0xe9;  // call/jmp rel32
+		addend = -4;
+		memcpy(code + pos, &addend, 4);
+		rel->info = R32_INFO(sym, R_386_PC32);
+		return 1;
+	}
+	else {
+		return 0;
+	}
+	rel->info = R32_INFO(sym, R_386_32);
+	return 1;
+}
+
+void check_shdr_idx(u32 idx);
+
+// relaxes the got loads of the input, and finds the entries left
+void prepare_got(void) {
+	int i, j;
+	for (i = 0; i < in_ehdr.shdr_cnt; i++) {
+		Shdr32 shdr, target;
+		memcpy(&shdr, in_file.ptr + in_ehdr.shdr_pos + i * sizeof(shdr), sizeof(shdr));
+		if (shdr.type != SHT_REL)
+			continue;
+		check_shdr_idx(shdr.info);
+		memcpy(&target,
+			in_file.ptr + in_ehdr.shdr_pos + shdr.info * sizeof(target),
+			sizeof(target));
+		for (j = 0; j + sizeof(Rel32) <= shdr.size; j += sizeof(Rel32)) {
+			Rel32 rel;
+			u32 type;
+			memcpy(&rel, in_file.ptr + shdr.pos + j, sizeof(rel));
+			type = R32_TYPE(rel.info);
+			if (type == R_386_GOTPC)
+				got_base_used = 1;
+			if (type != R_386_GOT32 && type != R_386_GOT32X)
+				continue;
+			if (!(target.flags & SHF_EXECINSTR) || target.type == SHT_NOBITS ||
+			!relax_got_load((u8 *) in_file.ptr + target.pos, target.size, &rel))
+				got_entry(R32_SYM(rel.info));
+			memcpy(in_file.ptr + shdr.pos + j, &rel, sizeof(rel));
+		}
+	}
+}
+
+void conv_symtab(Shdr32 *in_shdr, Shdr64 *out_shdr) {
+	int i, cnt;
+	char *in_shdr_tbl;
+	char *in_sym_tbl;
+	char *in_str_tbl;
+	Str stubs = { 0 };
+	Str sym_tbl = { 0 };
+	Str loc_sym_tbl = { 0 };
+	Str ext_sym_tbl = { 0 };
+	Str rela_tbl = { 0 };
+	Str eh_frame = { 0 };
+	Str eh_rela_tbl = { 0 };
+	Str slots = { 0 };
+	Str got = { 0 };
+	Str got_rela_tbl = { 0 };
+	u16 stub_idx, rela_idx, eh_rela_idx = 0, got_idx = 0, got_rela_idx = 0;
+	u32 thunk_sym = 0;
+	
+	cnt = in_shdr->size / sizeof(Sym32);
+	if (copied_sym_idx)
+		error("multiple symbol tables");
+	copied_sym_idx = calloc(cnt, sizeof(u16));
+	if (!copied_sym_idx)
+		error("out of memory");
+	copied_sym_idx_cnt = cnt;
+
+	in_shdr_tbl = in_file.ptr + in_ehdr.shdr_pos;
+	in_sym_tbl = in_file.ptr + in_shdr->pos;
+	{
+		Shdr32 shdr;
+		memcpy(&shdr, in_shdr_tbl + in_shdr->link * sizeof(shdr), sizeof(shdr));
+		in_str_tbl = in_file.ptr + shdr.pos;
+	}
+
+	{
+		Sym64 sym = { 0 };
+		append(&loc_sym_tbl, &sym, sizeof(sym));
+	}
+	new_sym_idx_off = 1;
+
+	// first, count how many symbols we'll have to generate stubs for
+	for (i = 0; i < cnt; i++) {
+		Sym32 in_sym;
+		char *name;
+		Sig *sig;
 		memcpy(&in_sym, in_sym_tbl + i * sizeof(in_sym), sizeof(in_sym));
 		name = in_str_tbl + in_sym.name_idx;
-		if (find_fn(name)) {
+		sig = find_fn(name);
+		// a local definition wins over a builtin
+		if (sig && sig->builtin && in_sym.shdr_idx)
+			sig = 0;
+		if (sig) {
 			if (!in_sym.shdr_idx ||
 			(in_sym.info == ST_INFO(STB_GLOBAL, STT_FUNC) &&
-			SHN_ISREAL(in_sym.shdr_idx)))
+			SHN_ISREAL(in_sym.shdr_idx))) {
 				copied_sym_idx[i] = new_sym_idx_off++;
+				// the stub marker follows the copy
+				if (!sig->builtin)
+					new_sym_idx_off++;
+				if (sig->fnptr_cnt && in_sym.shdr_idx)
+					thunk_sym = 1;
+			}
 		}
 	}
+	// the thunks and their slots come after all the other local symbols
+	if (thunk_sym) {
+		thunk_sym = new_sym_idx_off;
+		thunk_pool_sym = thunk_sym;
+		thunk_slots_sym = new_sym_idx_off + 1;
+		new_sym_idx_off += 2;
+	}
+	if (trace_stubs)
+		trace_names_sym = new_sym_idx_off++;
+	// then the got's, see prepare_got
+	if (got_base_used)
+		got_base_sym = new_sym_idx_off++;
+	if (got_ents.size)
+		got_sym = new_sym_idx_off++;
+
+	// the tracing hooks are the first symbols after the input's ones
+	if (trace_stubs) {
+		trace_sym = new_sym_idx_off + cnt;
+		add_extern_sym(&ext_sym_tbl, "__conv_trace_enter");
+		add_extern_sym(&ext_sym_tbl, "__conv_trace_exit");
+	}
+
+	append_cie(&eh_frame);
+	stub_pieces.size = 0;
+	if (thunk_sym)
+		add_stub_piece(0, -1);
+	if (thunk_sym)
+		make_thunks(&stubs, &rela_tbl, &eh_frame, &eh_rela_tbl, thunk_sym);
 
 	for (i = 0; i < cnt; i++) {
 		Sym32 in_sym;
@@ -577,35 +2591,107 @@ void conv_symtab(Shdr32 *in_shdr, Shdr64 *out_shdr) {
 		Sig *sig = 0;
 		Sym64 out_sym;
 		Sym64 out_loc_sym;
+		Sym64 out_ext_sym;
+		Sym64 out_marker;
 		Rela64 out_rela;
+		u32 stub_offset = stubs.size;
 
 		memcpy(&in_sym, in_sym_tbl + i * sizeof(in_sym), sizeof(in_sym));
 		name = in_str_tbl + in_sym.name_idx;
 		sig = find_fn(name);
+		if (sig && sig->builtin && in_sym.shdr_idx)
+			sig = 0;
+
+		if (sig && (in_sym.shdr_idx ? in_sym.info == ST_INFO(STB_GLOBAL, STT_FUNC) &&
+		SHN_ISREAL(in_sym.shdr_idx) : 1))
+			add_stub_piece(stub_offset, in_sym.name_idx);
 
 		if (in_sym.info == ST_INFO(STB_GLOBAL, STT_FUNC) &&
 		SHN_ISREAL(in_sym.shdr_idx) && sig) {
-			conv_sym_global(&in_sym, i, sig, &stubs, &out_sym, &out_loc_sym, &out_rela);
+			conv_sym_global(&in_sym, i, sig, &stubs, &out_sym, &out_loc_sym,
+				&out_ext_sym, &out_rela);
+			conv_stub_marker("__conv_g2c_", &in_sym, &out_sym, &out_marker);
 			append(&loc_sym_tbl, &out_loc_sym, sizeof(out_loc_sym));
+			append(&loc_sym_tbl, &out_marker, sizeof(out_marker));
+			append(&ext_sym_tbl, &out_ext_sym, sizeof(out_ext_sym));
 			append(&rela_tbl, &out_rela, sizeof(out_rela));
+			add_marker_relas(&rela_tbl, copied_sym_idx[i] + 1, stub_offset);
+			append_fde(&eh_frame, &eh_rela_tbl, copied_sym_idx[i] + 1, 0,
+				stubs.size - stub_offset);
 		}
 		else if (!in_sym.shdr_idx && sig) {
-			conv_sym_extern(&in_sym, i, sig, &stubs, &out_sym, &out_loc_sym, &out_rela);
+			int has_stub = conv_sym_extern(&in_sym, i, sig, &stubs,
+				&out_sym, &out_loc_sym, &out_rela);
 			append(&loc_sym_tbl, &out_loc_sym, sizeof(out_loc_sym));
-			append(&rela_tbl, &out_rela, sizeof(out_rela));
+			if (has_stub) {
+				conv_stub_marker("__conv_c2g_", &in_sym, &out_loc_sym, &out_marker);
+				append(&loc_sym_tbl, &out_marker, sizeof(out_marker));
+				append(&rela_tbl, &out_rela, sizeof(out_rela));
+				add_marker_relas(&rela_tbl, copied_sym_idx[i] + 1, stub_offset);
+				append_fde(&eh_frame, &eh_rela_tbl, copied_sym_idx[i] + 1, 0,
+					stubs.size - stub_offset);
+				// calls go through a weak __conv32_<name> at the stub, so
+				// they go straight to the 32-bit code of another converted
+				// object exporting the function, if it's linked in
+				conv_sym_alias(&in_sym, &out_loc_sym, STB_WEAK, &out_ext_sym);
+				copied_sym_idx[i] = new_sym_idx_off + cnt +
+					ext_sym_tbl.size / sizeof(Sym64);
+				append(&ext_sym_tbl, &out_ext_sym, sizeof(out_ext_sym));
+			}
 		}
 		else {
 			conv_sym_other(&in_sym, &out_sym);
 		}
 		append(&sym_tbl, &out_sym, sizeof(out_sym));
 	}
+	stub_idx = out_shdr_tbl.size / sizeof(Shdr64);
+	if (thunk_sym) {
+		slots.size = callback_cnt * THUNK_CNT * 8;
+		slots.ptr = calloc(slots.size, 1);
+		if (!slots.ptr)
+			error("out of memory");
+		add_local_sym(&loc_sym_tbl, "__conv_thunks", STT_FUNC, stub_idx,
+			thunk_pool[callback_cnt - 1] + thunk_size[callback_cnt - 1] * THUNK_CNT);
+		add_local_sym(&loc_sym_tbl, "__conv_thunk_slots", STT_OBJECT,
+			stub_idx + stub_piece_cnt(), slots.size);
+	}
+	// before the symbols of the sections after the stubs, which would
+	// pass for stub ones when there are no stubs
+	if (split_stubs) {
+		stub_idx = out_shdr_tbl.size / sizeof(Shdr64);
+		split_stub_syms(&loc_sym_tbl, stub_idx);
+		split_stub_syms(&sym_tbl, stub_idx);
+		split_stub_syms(&ext_sym_tbl, stub_idx);
+	}
+	// .rodata.conv and the got follow the stubs and slots
+	if (trace_stubs)
+		add_local_sym(&loc_sym_tbl, "__conv_trace_names", STT_OBJECT,
+			stub_idx + stub_piece_cnt() + (thunk_sym != 0), trace_names.size);
+	if (got_base_used)
+		add_local_sym(&loc_sym_tbl, "__conv_got_base", STT_NOTYPE, SHN_ABS, 0);
+	if (got_ents.size) {
+		u32 *ent = (u32 *) got_ents.ptr;
+		got.size = got_ents.size;
+		got.ptr = calloc(got.size, 1);
+		if (!got.ptr)
+			error("out of memory");
+		for (i = 0; i < got_ents.size / 4; i++) {
+			Rela64 rela;
+			rela.offset = i * 4;
+			rela.info = R64_INFO(sym_idx_to_64(ent[i]), R_X86_64_32);
+			rela.addend = 0;
+			append(&got_rela_tbl, &rela, sizeof(rela));
+		}
+		add_local_sym(&loc_sym_tbl, "__conv_got", STT_OBJECT,
+			stub_idx + stub_piece_cnt() + (thunk_sym != 0) + trace_stubs, got.size);
+	}
 
 	out_shdr->name_idx = in_shdr->name_idx;
 	out_shdr->type = SHT_SYMTAB;
 	out_shdr->flags = in_shdr->flags;
 	out_shdr->addr = 0;
 	out_shdr->pos = sizeof(Ehdr64) + out_sections.size;
-	out_shdr->size = loc_sym_tbl.size + sym_tbl.size;
+	out_shdr->size = loc_sym_tbl.size + sym_tbl.size + ext_sym_tbl.size;
 	out_shdr->link = new_shdr_idx[in_shdr->link];
 	out_shdr->info = in_shdr->info + new_sym_idx_off;
 	out_shdr->align = 8;
@@ -613,70 +2699,123 @@ void conv_symtab(Shdr32 *in_shdr, Shdr64 *out_shdr) {
 
 	append(&out_sections, loc_sym_tbl.ptr, loc_sym_tbl.size);
 	append(&out_sections, sym_tbl.ptr, sym_tbl.size);
+	append(&out_sections, ext_sym_tbl.ptr, ext_sym_tbl.size);
 	
+	// the symbol table comes right after the sections we add here
+	if (split_stubs) {
+		StubPiece *piece = (StubPiece *) stub_pieces.ptr;
+		int piece_cnt = stub_piece_cnt();
+		stub_idx = out_shdr_tbl.size / sizeof(Shdr64);
+		for (i = 0; i < piece_cnt; i++) {
+			u32 end = i + 1 < piece_cnt ? piece[i + 1].start : stubs.size;
+			Str data = { stubs.ptr + piece[i].start, end - piece[i].start };
+			char *name = stub_piece_name(".text.conv.", i);
+			add_section(name, SHT_PROGBITS, SHF_ALLOC | SHF_EXECINSTR, &data, 0, 16, 0);
+			free(name);
+		}
+	}
+	else {
+		stub_idx = add_section(0, SHT_PROGBITS, SHF_ALLOC | SHF_EXECINSTR, &stubs, 0, 0, 0);
+	}
+	if (thunk_sym)
+		add_section(".data.conv.thunk_slots", SHT_PROGBITS, SHF_ALLOC | SHF_WRITE,
+			&slots, 0, 8, 0);
+	if (trace_stubs)
+		add_section(".rodata.conv", SHT_PROGBITS, SHF_ALLOC, &trace_names, 0, 1, 0);
+	if (got_ents.size)
+		got_idx = add_section(".data.conv.got", SHT_PROGBITS, SHF_ALLOC | SHF_WRITE,
+			&got, 0, 4, 0);
+	rela_idx = out_shdr_tbl.size / sizeof(Shdr64);
+	if (split_stubs) {
+		for (i = 0; i < stub_piece_cnt(); i++) {
+			Str relas = { 0 };
+			char *name = stub_piece_name(".rela.text.conv.", i);
+			split_stub_relas(&relas, &rela_tbl, i);
+			add_section(name, SHT_RELA, 0, &relas, stub_idx + i, 8, sizeof(Rela64));
+			free(name);
+			free(relas.ptr);
+		}
+	}
+	else {
+		add_section(0, SHT_RELA, 0, &rela_tbl, stub_idx, 8, sizeof(Rela64));
+	}
+	if (got_ents.size)
+		got_rela_idx = add_section(".rela.data.conv.got", SHT_RELA, 0,
+			&got_rela_tbl, got_idx, 8, sizeof(Rela64));
+	if (eh_rela_tbl.size) {
+		u16 eh_idx = add_section(".eh_frame", SHT_X86_64_UNWIND, SHF_ALLOC,
+			&eh_frame, 0, 8, 0);
+		eh_rela_idx = add_section(".rela.eh_frame", SHT_RELA, 0,
+			&eh_rela_tbl, eh_idx, 8, sizeof(Rela64));
+	}
+	add_section(".conv.sigs", SHT_PROGBITS, SHF_EXCLUDE, &conv_sigs, 0, 1, 0);
 	{
-		Shdr64 shdr;
-
-		shdr.name_idx = 0;
-		shdr.type = SHT_PROGBITS;
-		shdr.flags = SHF_ALLOC | SHF_EXECINSTR;
-		shdr.addr = 0;
-		shdr.pos = sizeof(Ehdr64) + out_sections.size;
-		shdr.size = stubs.size;
-		shdr.link = 0;
-		shdr.info = 0;
-		shdr.align = 0;
-		shdr.ent_size = 0;
-		append(&out_shdr_tbl, &shdr, sizeof(shdr));
-		append(&out_sections, stubs.ptr, stubs.size);
-
-		shdr.name_idx = 0;
-		shdr.type = SHT_RELA;
-		shdr.flags = 0;
-		shdr.addr = 0;
-		shdr.pos = sizeof(Ehdr64) + out_sections.size;
-		shdr.size = rela_tbl.size;
-		shdr.link = out_shdr_tbl.size / sizeof(Shdr64) + 1;
-		shdr.info = out_shdr_tbl.size / sizeof(Shdr64) - 1;
-		shdr.align = 8;
-		shdr.ent_size = sizeof(Rela64);
-		append(&out_shdr_tbl, &shdr, sizeof(shdr));
-		append(&out_sections, rela_tbl.ptr, rela_tbl.size);
+		Shdr64 *shdr_tbl = (Shdr64 *) out_shdr_tbl.ptr;
+		u16 symtab_idx = out_shdr_tbl.size / sizeof(Shdr64);
+		for (i = 0; i < stub_piece_cnt(); i++)
+			shdr_tbl[rela_idx + i].link = symtab_idx;
+		if (eh_rela_idx)
+			shdr_tbl[eh_rela_idx].link = symtab_idx;
+		if (got_rela_idx)
+			shdr_tbl[got_rela_idx].link = symtab_idx;
 	}
 	
 	free(stubs.ptr);
 	free(sym_tbl.ptr);
 	free(loc_sym_tbl.ptr);
+	free(ext_sym_tbl.ptr);
 	free(rela_tbl.ptr);
+	free(eh_frame.ptr);
+	free(eh_rela_tbl.ptr);
+	free(slots.ptr);
+	free(trace_names.ptr);
+	free(got.ptr);
+	free(got_rela_tbl.ptr);
 }
 
 u64 r_info_to_64(u32 info) {
-	u32 sym  = R32_SYM(info);
+	u32 sym  = sym_idx_to_64(R32_SYM(info));
 	u32 type = R32_TYPE(info);
-	if (sym >= copied_sym_idx_cnt)
-		error("index out of range");
-	if (copied_sym_idx[sym])
-		sym = copied_sym_idx[sym];
-	else
-		sym += new_sym_idx_off;
 	switch (type) {
 		case R_386_32:
+		case R_386_GOTOFF:
 			type = R_X86_64_32; break;
 		case R_386_PC32:
 		case R_386_PLT32:
 			type = R_X86_64_PC32; break;
+		// the got is at 0, and the loads left go through the local got
+		case R_386_GOTPC:
+			sym = got_base_sym;
+			type = R_X86_64_PC32; break;
+		case R_386_GOT32:
+		case R_386_GOT32X:
+			sym = got_sym;
+			type = R_X86_64_32; break;
 		default:
 			error("unsupported relocation");
 	}
 	return R64_INFO(sym, type);
 }
 
+// i386 keeps the addends in the relocated fields themselves
+s64 rel_addend(Shdr32 *shdr, u32 offset) {
+	int addend;
+	if (shdr->type == SHT_NOBITS || offset > shdr->size || shdr->size - offset < 4)
+		error("relocation out of range");
+	memcpy(&addend, in_file.ptr + shdr->pos + offset, 4);
+	return addend;
+}
+
 void conv_rel(Shdr32 *in_shdr, Shdr64 *out_shdr) {
 	int i, cnt;
 	char *rel_tbl;
+	Shdr32 target;
 
 	cnt = in_shdr->size / sizeof(Rel32);
 	rel_tbl = in_file.ptr + in_shdr->pos;
+	memcpy(&target,
+		in_file.ptr + in_ehdr.shdr_pos + in_shdr->info * sizeof(target),
+		sizeof(target));
 
 	out_shdr->name_idx = in_shdr->name_idx;
 	out_shdr->type = SHT_RELA;
@@ -695,11 +2834,81 @@ void conv_rel(Shdr32 *in_shdr, Shdr64 *out_shdr) {
 		memcpy(&in_rel, rel_tbl + i * sizeof(Rel32), sizeof(Rel32));
 		out_rela.offset = in_rel.offset;
 		out_rela.info = r_info_to_64(in_rel.info);
-		out_rela.addend = 0;
+		out_rela.addend = rel_addend(&target, in_rel.offset);
+		if (R32_TYPE(in_rel.info) == R_386_GOT32 || R32_TYPE(in_rel.info) == R_386_GOT32X)
+			out_rela.addend += got_entry(R32_SYM(in_rel.info)) * 4;
 		append(&out_sections, &out_rela, sizeof(Rela64));
 	}
 }
 
+char *shdr_name(Shdr32 *shdr) {
+	Shdr32 str_shdr;
+	memcpy(&str_shdr,
+		in_file.ptr + in_ehdr.shdr_pos + in_ehdr.shdr_str_tbl_idx * sizeof(str_shdr),
+		sizeof(str_shdr));
+	if (shdr->name_idx >= str_shdr.size)
+		error("index out of range");
+	return in_file.ptr + str_shdr.pos + shdr->name_idx;
+}
+
+int is_debug_shdr(Shdr32 *shdr) {
+	return strncmp(shdr_name(shdr), ".debug", 6) == 0;
+}
+
+/*
+compressed sections begin with a compression header, which
+is bigger in elf64. the compressed data itself stays the same.
+*/
+void conv_compressed(Shdr32 *in_shdr, Shdr64 *out_shdr) {
+	Chdr32 in_chdr;
+	Chdr64 out_chdr;
+
+	if (in_shdr->size < sizeof(in_chdr))
+		error("bad compressed section");
+	memcpy(&in_chdr, in_file.ptr + in_shdr->pos, sizeof(in_chdr));
+	out_chdr.type = in_chdr.type;
+	out_chdr.reserved = 0;
+	out_chdr.size = in_chdr.size;
+	out_chdr.align = in_chdr.align;
+
+	out_shdr->size = in_shdr->size - sizeof(in_chdr) + sizeof(out_chdr);
+	out_shdr->align = 8;
+	append(&out_sections, &out_chdr, sizeof(out_chdr));
+	append(&out_sections, in_file.ptr + in_shdr->pos + sizeof(in_chdr),
+		in_shdr->size - sizeof(in_chdr));
+}
+
+void conv_compress(Shdr32 *in_shdr, Shdr64 *out_shdr) {
+	Chdr64 chdr;
+	uLongf size;
+	Bytef *buf;
+
+	size = compressBound(in_shdr->size);
+	buf = malloc(size);
+	if (!buf) error("out of memory");
+	if (compress2(buf, &size, (Bytef *) in_file.ptr + in_shdr->pos,
+	in_shdr->size, Z_DEFAULT_COMPRESSION) != Z_OK)
+		error("can't compress section");
+	if (sizeof(chdr) + size >= in_shdr->size) {
+		// not worth it
+		append(&out_sections, in_file.ptr + in_shdr->pos, in_shdr->size);
+		free(buf);
+		return;
+	}
+
+	chdr.type = ELFCOMPRESS_ZLIB;
+	chdr.reserved = 0;
+	chdr.size = in_shdr->size;
+	chdr.align = in_shdr->align;
+
+	out_shdr->flags |= SHF_COMPRESSED;
+	out_shdr->size = sizeof(chdr) + size;
+	out_shdr->align = 8;
+	append(&out_sections, &chdr, sizeof(chdr));
+	append(&out_sections, buf, size);
+	free(buf);
+}
+
 void conv_other(Shdr32 *in_shdr, Shdr64 *out_shdr) {
 	out_shdr->name_idx = in_shdr->name_idx;
 	out_shdr->type = in_shdr->type;
@@ -711,7 +2920,39 @@ void conv_other(Shdr32 *in_shdr, Shdr64 *out_shdr) {
 	out_shdr->info = in_shdr->info;
 	out_shdr->align = in_shdr->align;
 	out_shdr->ent_size = in_shdr->ent_size;
-	append(&out_sections, in_file.ptr + in_shdr->pos, in_shdr->size);
+
+	if (in_shdr->flags & SHF_COMPRESSED)
+		conv_compressed(in_shdr, out_shdr);
+	else if (compress_debug && in_shdr->type == SHT_PROGBITS &&
+	in_shdr->size && !(in_shdr->flags & SHF_ALLOC) && is_debug_shdr(in_shdr))
+		conv_compress(in_shdr, out_shdr);
+	else
+		append(&out_sections, in_file.ptr + in_shdr->pos, in_shdr->size);
+}
+
+// only the header is written now, see finish_strtab
+void conv_strtab(Shdr32 *in_shdr, Shdr64 *out_shdr, StrTab *tbl) {
+	out_shdr->name_idx = in_shdr->name_idx;
+	out_shdr->type = in_shdr->type;
+	out_shdr->flags = in_shdr->flags;
+	out_shdr->addr = 0;
+	out_shdr->pos = 0;
+	out_shdr->size = 0;
+	out_shdr->link = 0;
+	out_shdr->info = 0;
+	out_shdr->align = in_shdr->align;
+	out_shdr->ent_size = in_shdr->ent_size;
+	tbl->out_idx = out_shdr_tbl.size / sizeof(Shdr64);
+}
+
+void finish_strtab(StrTab *tbl) {
+	Shdr64 *shdr;
+	if (!tbl->out_idx)
+		return;
+	shdr = (Shdr64 *) out_shdr_tbl.ptr + tbl->out_idx;
+	shdr->pos = sizeof(Ehdr64) + out_sections.size;
+	shdr->size = tbl->strs.size;
+	append(&out_sections, tbl->strs.ptr, tbl->strs.size);
 }
 
 void check_shdr_idx(u32 idx) {
@@ -719,6 +2960,38 @@ void check_shdr_idx(u32 idx) {
 		error("index out of range");
 }
 
+// names can be added before the table itself is converted
+void init_strtab(StrTab *tbl, u32 idx) {
+	Shdr32 shdr;
+	check_shdr_idx(idx);
+	memcpy(&shdr, in_file.ptr + in_ehdr.shdr_pos + idx * sizeof(shdr), sizeof(shdr));
+	if (shdr.type != SHT_STRTAB)
+		error("bad string table");
+	tbl->in_idx = idx;
+	append(&tbl->strs, in_file.ptr + shdr.pos, shdr.size);
+}
+
+int is_dropped(Shdr32 *shdr) {
+	if (shdr->type == SHT_NOTE)
+		return 1;
+	if (shdr->type == SHT_REL) {
+		Shdr32 target;
+		check_shdr_idx(shdr->info);
+		memcpy(&target,
+			in_file.ptr + in_ehdr.shdr_pos + shdr->info * sizeof(target),
+			sizeof(target));
+		return target.type != SHT_REL && is_dropped(&target);
+	}
+	// i386 unwind info would only confuse a 64-bit unwinder
+	if (strcmp(shdr_name(shdr), ".eh_frame") == 0)
+		return 1;
+	if (strip_debug && is_debug_shdr(shdr))
+		return 1;
+	if (strip_comment && strcmp(shdr_name(shdr), ".comment") == 0)
+		return 1;
+	return 0;
+}
+
 void conv_shdr(int idx);
 void conv_symtab_refs(Shdr32 *shdr) {
 	int i;
@@ -733,6 +3006,59 @@ void conv_symtab_refs(Shdr32 *shdr) {
 	}
 }
 
+/*
+a section group (like the comdat pic code keeps __x86.get_pc_thunk.bx
+in) is named by a symbol, and lists its members by index. groups
+must come before their members, so their headers are converted
+first, and the rest once the members are (see finish_groups).
+*/
+void conv_group(Shdr32 *in_shdr, Shdr64 *out_shdr) {
+	if (in_shdr->size < 4)
+		error("bad section group");
+	out_shdr->name_idx = in_shdr->name_idx;
+	out_shdr->type = SHT_GROUP;
+	out_shdr->flags = in_shdr->flags;
+	out_shdr->addr = 0;
+	out_shdr->pos = 0;
+	out_shdr->size = 0;
+	out_shdr->link = 0;
+	out_shdr->info = 0;
+	out_shdr->align = 4;
+	out_shdr->ent_size = 4;
+}
+
+// the dropped members are left out
+void finish_groups(void) {
+	int i, j;
+	for (i = 0; i < in_ehdr.shdr_cnt; i++) {
+		Shdr32 in_shdr;
+		Shdr64 *out_shdr;
+		Str data = { 0 };
+		u32 ent;
+
+		memcpy(&in_shdr, in_file.ptr + in_ehdr.shdr_pos + i * sizeof(in_shdr),
+			sizeof(in_shdr));
+		if (in_shdr.type != SHT_GROUP || !new_shdr_idx[i])
+			continue;
+		append(&data, in_file.ptr + in_shdr.pos, 4);
+		for (j = 4; j + 4 <= in_shdr.size; j += 4) {
+			memcpy(&ent, in_file.ptr + in_shdr.pos + j, 4);
+			check_shdr_idx(ent);
+			if (new_shdr_idx[ent]) {
+				ent = new_shdr_idx[ent];
+				append(&data, &ent, 4);
+			}
+		}
+		out_shdr = (Shdr64 *) out_shdr_tbl.ptr + new_shdr_idx[i];
+		out_shdr->pos = sizeof(Ehdr64) + out_sections.size;
+		out_shdr->size = data.size;
+		out_shdr->link = new_shdr_idx[in_shdr.link];
+		out_shdr->info = sym_idx_to_64(in_shdr.info);
+		append(&out_sections, data.ptr, data.size);
+		free(data.ptr);
+	}
+}
+
 void conv_shdr(int idx) {
 	Shdr32 in_shdr;
 	Shdr64 out_shdr;
@@ -741,6 +3067,8 @@ void conv_shdr(int idx) {
 	memcpy(&in_shdr,
 		in_file.ptr + in_ehdr.shdr_pos + idx * sizeof(in_shdr),
 		sizeof(in_shdr));
+	if (in_shdr.type != SHT_NULL && is_dropped(&in_shdr))
+		return;
 
 	switch (in_shdr.type) {
 		case 0:
@@ -753,8 +3081,6 @@ void conv_shdr(int idx) {
 			conv_symtab_refs(&in_shdr);
 			conv_symtab(&in_shdr, &out_shdr);
 			break;
-		case SHT_NOTE:
-			return;
 		case SHT_REL:
 			check_shdr_idx(in_shdr.link);
 			check_shdr_idx(in_shdr.info);
@@ -764,8 +3090,17 @@ void conv_shdr(int idx) {
 				conv_shdr(in_shdr.info);
 			conv_rel(&in_shdr, &out_shdr);
 			break;
+		case SHT_GROUP:
+			check_shdr_idx(in_shdr.link);
+			conv_group(&in_shdr, &out_shdr);
+			break;
 		default:
-			conv_other(&in_shdr, &out_shdr);
+			if (idx == sym_strs.in_idx)
+				conv_strtab(&in_shdr, &out_shdr, &sym_strs);
+			else if (idx == sh_strs.in_idx)
+				conv_strtab(&in_shdr, &out_shdr, &sh_strs);
+			else
+				conv_other(&in_shdr, &out_shdr);
 	}
 	new_shdr_idx[idx] = out_shdr_tbl.size / sizeof(Shdr64);
 	append(&out_shdr_tbl, &out_shdr, sizeof(Shdr64));
@@ -824,33 +3159,1154 @@ int copy_and_check_ehdr(void) {
 
 
 
-int main(int argc, char **argv) {
-	int i;
+// input merging
+
+/*
+when given several input files, we first link them together into
+a single elf32 ET_REL (like ld -r would), and then convert that as
+usual. this way every function gets exactly one stub, no matter
+how many of the inputs define or use it.
+	* sections with the same name, type and flags are concatenated.
+	* every merged section gets one section symbol.
+	* local symbols are copied, global symbols are merged by name.
+	* relocations are moved along with their sections. relocations
+		against section symbols have their implicit addends moved
+		by the offset of the original section in the merged one.
+	* a comdat group is kept from the first input having it. its
+		copies in later inputs are dropped, their members mapped to
+		the kept ones, and the globals they define become
+		references. kept members aren't concatenated with anything.
+*/
 
-	if (argc != 4)
-		error("usage: %s <in ET_REL> <flist> <out ET_REL>", argv[0]);
+typedef struct MSec MSec;
+struct MSec {
+	char *name;
+	Shdr32 shdr;
+	Str data;
+	Str rels;
+	// the signature of a group, whose data lists its members
+	char *sig;
+};
 
-	if (!read_file(&in_file, argv[1], 0))
-		error("%s: can't open", argv[1]);
+typedef struct MIn MIn;
+struct MIn {
+	char *name;
+	Str file;
+	Ehdr32 ehdr;
+	u32 symtab_idx;
+	// merged section index + 1 of every section
+	u32 *sec_map;
+	// offset of every section inside the merged one
+	u32 *sec_off;
+	// merged index of every symbol
+	u32 *sym_map;
+	// sections of comdat groups kept from an earlier input
+	u8 *discarded;
+};
+
+MSec *msecs;
+u32 msec_cnt;
+Str m_locals;
+Str m_globals;
+Str m_strs;
+
+void select_input(MIn *in) {
+	in_file = in->file;
+	in_ehdr = in->ehdr;
+}
+
+void get_shdr(u32 idx, Shdr32 *shdr) {
+	check_shdr_idx(idx);
+	memcpy(shdr, in_file.ptr + in_ehdr.shdr_pos + idx * sizeof(*shdr), sizeof(*shdr));
+}
+
+void get_sym(Shdr32 *symtab, u32 idx, Sym32 *sym) {
+	if (idx >= symtab->size / sizeof(*sym))
+		error("index out of range");
+	memcpy(sym, in_file.ptr + symtab->pos + idx * sizeof(*sym), sizeof(*sym));
+}
+
+char *sym_name(Shdr32 *symtab, Sym32 *sym) {
+	Shdr32 strtab;
+	get_shdr(symtab->link, &strtab);
+	if (sym->name_idx >= strtab.size)
+		error("index out of range");
+	return in_file.ptr + strtab.pos + sym->name_idx;
+}
+
+u32 new_msec(Shdr32 *shdr, char *name) {
+	msecs = realloc(msecs, (msec_cnt + 1) * sizeof(MSec));
+	if (!msecs) error("out of memory");
+	memset(&msecs[msec_cnt], 0, sizeof(MSec));
+	msecs[msec_cnt].name = name;
+	msecs[msec_cnt].shdr = *shdr;
+	msecs[msec_cnt].shdr.size = 0;
+	msecs[msec_cnt].shdr.align = 1;
+	return msec_cnt++;
+}
+
+u32 find_msec(Shdr32 *shdr, char *name) {
+	u32 i;
+	for (i = 0; i < msec_cnt; i++) {
+		if (strcmp(msecs[i].name, name) == 0 &&
+		msecs[i].shdr.type == shdr->type &&
+		msecs[i].shdr.flags == shdr->flags && !(shdr->flags & SHF_GROUP))
+			return i;
+	}
+	return new_msec(shdr, name);
+}
+
+// appends section i of the input to merged section off
+void merge_section(MIn *in, u32 i, Shdr32 *shdr, u32 off) {
+	MSec *m = &msecs[off];
+	if (shdr->align > m->shdr.align)
+		m->shdr.align = shdr->align;
+	off = m->shdr.size;
+	if (shdr->align > 1)
+		off = (off + shdr->align - 1) & -shdr->align;
+	if (shdr->type != SHT_NOBITS) {
+		static char zeros[16];
+		while (m->data.size < off)
+			append(&m->data, zeros, off - m->data.size < 16 ? off - m->data.size : 16);
+		append(&m->data, in_file.ptr + shdr->pos, shdr->size);
+	}
+	m->shdr.size = off + shdr->size;
+	in->sec_map[i] = m - msecs + 1;
+	in->sec_off[i] = off;
+}
+
+u32 find_group(char *sig) {
+	u32 i;
+	for (i = 0; i < msec_cnt; i++) {
+		if (msecs[i].sig && strcmp(msecs[i].sig, sig) == 0)
+			return i + 1;
+	}
+	return 0;
+}
+
+// the merged section of the kept group member named name
+u32 find_member(MIn *in, u32 group, char *name) {
+	u32 *ent = (u32 *) msecs[group].data.ptr;
+	u32 i;
+	for (i = 1; i < msecs[group].data.size / 4; i++) {
+		if (strcmp(msecs[ent[i] - 1].name, name) == 0)
+			return ent[i];
+	}
+	error("%s: comdat group %s differs from an earlier one", in->name, msecs[group].sig);
+	return 0;
+}
+
+void merge_groups(MIn *in) {
+	u32 i, j;
+	for (i = 1; i < in_ehdr.shdr_cnt; i++) {
+		Shdr32 shdr, symtab, member;
+		Sym32 sym;
+		char *sig;
+		u32 flags, ent, kept = 0, m = 0;
+
+		get_shdr(i, &shdr);
+		if (shdr.type != SHT_GROUP)
+			continue;
+		if (shdr.size < 4)
+			error("%s: bad section group", in->name);
+		get_shdr(shdr.link, &symtab);
+		get_sym(&symtab, shdr.info, &sym);
+		if (ST_TYPE(sym.info) == STT_SECTION) {
+			get_shdr(sym.shdr_idx, &member);
+			sig = shdr_name(&member);
+		}
+		else {
+			sig = sym_name(&symtab, &sym);
+		}
+		memcpy(&flags, in_file.ptr + shdr.pos, 4);
+		if (flags & GRP_COMDAT)
+			kept = find_group(sig);
+		if (kept) {
+			in->discarded[i] = 1;
+		}
+		else {
+			m = new_msec(&shdr, shdr_name(&shdr));
+			msecs[m].sig = sig;
+			msecs[m].shdr.align = 4;
+			append(&msecs[m].data, &flags, 4);
+			in->sec_map[i] = m + 1;
+		}
+
+		for (j = 4; j + 4 <= shdr.size; j += 4) {
+			memcpy(&ent, in_file.ptr + shdr.pos + j, 4);
+			get_shdr(ent, &member);
+			// relocations follow their sections
+			if (member.type == SHT_REL) {
+				in->discarded[ent] = kept != 0;
+				continue;
+			}
+			if (kept) {
+				in->discarded[ent] = 1;
+				in->sec_map[ent] = find_member(in, kept - 1, shdr_name(&member));
+				in->sec_off[ent] = 0;
+			}
+			else {
+				u32 k = new_msec(&member, shdr_name(&member));
+				merge_section(in, ent, &member, k);
+				k++;
+				append(&msecs[m].data, &k, 4);
+			}
+		}
+	}
+}
+
+void merge_sections(MIn *in) {
+	u32 i;
+	merge_groups(in);
+	for (i = 1; i < in_ehdr.shdr_cnt; i++) {
+		Shdr32 shdr;
+
+		get_shdr(i, &shdr);
+		if (shdr.type == SHT_SYMTAB) {
+			if (in->symtab_idx)
+				error("%s: multiple symbol tables", in->name);
+			in->symtab_idx = i;
+		}
+		if (shdr.type == SHT_SYMTAB || shdr.type == SHT_STRTAB ||
+		shdr.type == SHT_REL || shdr.type == SHT_GROUP ||
+		in->sec_map[i] || in->discarded[i])
+			continue;
+		merge_section(in, i, &shdr, find_msec(&shdr, shdr_name(&shdr)));
+	}
+	if (!in->symtab_idx)
+		error("%s: no symbol table", in->name);
+}
+
+void merge_sym(MIn *in, Sym32 *in_sym, Sym32 *out_sym, char *name) {
+	*out_sym = *in_sym;
+	out_sym->name_idx = name ? add_str(&m_strs, name) : 0;
+	if (SHN_ISREAL(in_sym->shdr_idx)) {
+		check_shdr_idx(in_sym->shdr_idx);
+		out_sym->shdr_idx = in->sec_map[in_sym->shdr_idx];
+		out_sym->val += in->sec_off[in_sym->shdr_idx];
+	}
+}
+
+void merge_locals(MIn *in) {
+	Shdr32 symtab;
+	u32 i;
+
+	get_shdr(in->symtab_idx, &symtab);
+	for (i = 1; i < symtab.size / sizeof(Sym32); i++) {
+		Sym32 in_sym, out_sym;
+
+		get_sym(&symtab, i, &in_sym);
+		if (ST_BIND(in_sym.info) != STB_LOCAL)
+			continue;
+		if (ST_TYPE(in_sym.info) == STT_SECTION) {
+			check_shdr_idx(in_sym.shdr_idx);
+			in->sym_map[i] = in->sec_map[in_sym.shdr_idx];
+			continue;
+		}
+		merge_sym(in, &in_sym, &out_sym, sym_name(&symtab, &in_sym));
+		in->sym_map[i] = 1 + msec_cnt + m_locals.size / sizeof(Sym32);
+		append(&m_locals, &out_sym, sizeof(out_sym));
+	}
+}
+
+// 0 - undefined, 1 - common, 2 - weak, 3 - defined
+int sym_rank(Sym32 *sym) {
+	if (!sym->shdr_idx)
+		return 0;
+	if (sym->shdr_idx == SHN_COMMON)
+		return 1;
+	if (ST_BIND(sym->info) == STB_WEAK)
+		return 2;
+	return 3;
+}
+
+void merge_globals(MIn *in) {
+	Shdr32 symtab;
+	u32 i, j, cnt;
+
+	get_shdr(in->symtab_idx, &symtab);
+	for (i = 1; i < symtab.size / sizeof(Sym32); i++) {
+		Sym32 in_sym, out_sym;
+		char *name;
+
+		get_sym(&symtab, i, &in_sym);
+		if (ST_BIND(in_sym.info) == STB_LOCAL)
+			continue;
+		name = sym_name(&symtab, &in_sym);
+		// the kept copy of the group defines it
+		if (SHN_ISREAL(in_sym.shdr_idx)) {
+			check_shdr_idx(in_sym.shdr_idx);
+			if (in->discarded[in_sym.shdr_idx]) {
+				in_sym.shdr_idx = 0;
+				in_sym.val = 0;
+			}
+		}
+
+		cnt = m_globals.size / sizeof(Sym32);
+		for (j = 0; j < cnt; j++) {
+			Sym32 *sym = (Sym32 *) m_globals.ptr + j;
+			if (strcmp(m_strs.ptr + sym->name_idx, name) == 0)
+				break;
+		}
+		if (j == cnt) {
+			merge_sym(in, &in_sym, &out_sym, name);
+			append(&m_globals, &out_sym, sizeof(out_sym));
+		}
+		else {
+			Sym32 *sym = (Sym32 *) m_globals.ptr + j;
+			if (sym_rank(&in_sym) == 3 && sym_rank(sym) == 3)
+				error("%s: multiple definition of %s", in->name, name);
+			if (sym_rank(&in_sym) > sym_rank(sym)) {
+				u32 name_idx = sym->name_idx;
+				merge_sym(in, &in_sym, sym, 0);
+				sym->name_idx = name_idx;
+			}
+			else if (!sym->shdr_idx && ST_BIND(in_sym.info) == STB_GLOBAL) {
+				sym->info = ST_INFO(STB_GLOBAL, ST_TYPE(sym->info));
+			}
+			else if (sym->shdr_idx == SHN_COMMON && in_sym.shdr_idx == SHN_COMMON &&
+			in_sym.size > sym->size) {
+				sym->size = in_sym.size;
+			}
+		}
+		in->sym_map[i] = j;
+	}
+}
+
+void merge_rels(MIn *in) {
+	Shdr32 symtab;
+	u32 i, j, loc_cnt;
+
+	get_shdr(in->symtab_idx, &symtab);
+	loc_cnt = 1 + msec_cnt + m_locals.size / sizeof(Sym32);
+	for (i = 1; i < in_ehdr.shdr_cnt; i++) {
+		Shdr32 shdr;
+		MSec *m;
+		u32 off;
+
+		get_shdr(i, &shdr);
+		if (shdr.type != SHT_REL)
+			continue;
+		check_shdr_idx(shdr.info);
+		if (shdr.link != in->symtab_idx)
+			error("%s: relocations against a foreign symbol table", in->name);
+		if (in->discarded[i] || in->discarded[shdr.info])
+			continue;
+		if (!in->sec_map[shdr.info])
+			error("%s: relocations against an unmergeable section", in->name);
+		m = &msecs[in->sec_map[shdr.info] - 1];
+		off = in->sec_off[shdr.info];
+
+		for (j = 0; j < shdr.size / sizeof(Rel32); j++) {
+			Rel32 rel;
+			Sym32 sym;
+			u32 sym_idx;
+
+			memcpy(&rel, in_file.ptr + shdr.pos + j * sizeof(rel), sizeof(rel));
+			get_sym(&symtab, R32_SYM(rel.info), &sym);
+			sym_idx = in->sym_map[R32_SYM(rel.info)];
+			if (ST_BIND(sym.info) != STB_LOCAL)
+				sym_idx += loc_cnt;
+			rel.offset += off;
+			rel.info = R32_INFO(sym_idx, R32_TYPE(rel.info));
+
+			if (ST_TYPE(sym.info) == STT_SECTION && ST_BIND(sym.info) == STB_LOCAL) {
+				u32 addend;
+				if (rel.offset + 4 > m->data.size)
+					error("%s: relocation out of range", in->name);
+				memcpy(&addend, m->data.ptr + rel.offset, 4);
+				addend += in->sec_off[sym.shdr_idx];
+				memcpy(m->data.ptr + rel.offset, &addend, 4);
+			}
+			append(&m->rels, &rel, sizeof(rel));
+		}
+	}
+}
+
+// the signature symbols of the kept groups
+void merge_group_sigs(MIn *in) {
+	Shdr32 symtab;
+	u32 i, loc_cnt;
+
+	get_shdr(in->symtab_idx, &symtab);
+	loc_cnt = 1 + msec_cnt + m_locals.size / sizeof(Sym32);
+	for (i = 1; i < in_ehdr.shdr_cnt; i++) {
+		Shdr32 shdr;
+		Sym32 sym;
+
+		get_shdr(i, &shdr);
+		if (shdr.type != SHT_GROUP || in->discarded[i])
+			continue;
+		if (shdr.link != in->symtab_idx)
+			error("%s: section group of a foreign symbol table", in->name);
+		get_sym(&symtab, shdr.info, &sym);
+		msecs[in->sec_map[i] - 1].shdr.info = in->sym_map[shdr.info] +
+			(ST_BIND(sym.info) == STB_LOCAL ? 0 : loc_cnt);
+	}
+}
+
+// adds the relocation sections of the members, which come after the symtab
+void finish_msec_group(MSec *g, u32 symtab_idx) {
+	Str data = { 0 };
+	u32 *ent = (u32 *) g->data.ptr;
+	u32 i, j, rel_idx;
+
+	append(&data, &ent[0], 4);
+	for (i = 1; i < g->data.size / 4; i++) {
+		append(&data, &ent[i], 4);
+		if (!msecs[ent[i] - 1].rels.size)
+			continue;
+		// the symtab, the strtab, then the relocation sections in order
+		rel_idx = symtab_idx + 2;
+		for (j = 0; j < ent[i] - 1; j++) {
+			if (msecs[j].rels.size)
+				rel_idx++;
+		}
+		append(&data, &rel_idx, 4);
+	}
+	free(g->data.ptr);
+	g->data = data;
+	g->shdr.size = data.size;
+	g->shdr.link = symtab_idx;
+}
+
+void merge_inputs(char **names, int cnt) {
+	MIn *ins;
+	Str out = { 0 };
+	Str shdrs = { 0 };
+	Str shstrs = { 0 };
+	Ehdr32 ehdr;
+	Shdr32 shdr;
+	u32 i, loc_cnt, symtab_idx;
+
+	memset(&ehdr, 0, sizeof(ehdr));
+	ins = calloc(cnt, sizeof(MIn));
+	if (!ins) error("out of memory");
+	for (i = 0; i < cnt; i++) {
+		MIn *in = &ins[i];
+		in->name = names[i];
+		if (!read_file(&in->file, in->name, 0))
+			error("%s: can't open", in->name);
+		in_file = in->file;
+		if (!copy_and_check_ehdr())
+			error("%s: bad file", in->name);
+		in->ehdr = in_ehdr;
+		in->sec_map = calloc(in_ehdr.shdr_cnt, sizeof(u32));
+		in->sec_off = calloc(in_ehdr.shdr_cnt, sizeof(u32));
+		in->discarded = calloc(in_ehdr.shdr_cnt, 1);
+		if (!in->sec_map || !in->sec_off || !in->discarded)
+			error("out of memory");
+		merge_sections(in);
+	}
+
+	add_str(&m_strs, "");
+	for (i = 0; i < cnt; i++) {
+		Shdr32 symtab;
+		select_input(&ins[i]);
+		get_shdr(ins[i].symtab_idx, &symtab);
+		ins[i].sym_map = calloc(symtab.size / sizeof(Sym32) + 1, sizeof(u32));
+		if (!ins[i].sym_map)
+			error("out of memory");
+		merge_locals(&ins[i]);
+	}
+	for (i = 0; i < cnt; i++) {
+		select_input(&ins[i]);
+		merge_globals(&ins[i]);
+	}
+	for (i = 0; i < cnt; i++) {
+		select_input(&ins[i]);
+		merge_rels(&ins[i]);
+		merge_group_sigs(&ins[i]);
+	}
+
+	// lay out the merged file: sections, symtab, strtab, rels, shstrtab
+	append(&out, &ehdr, sizeof(ehdr));
+	add_str(&shstrs, "");
+	memset(&shdr, 0, sizeof(shdr));
+	append(&shdrs, &shdr, sizeof(shdr));
+	for (i = 0; i < msec_cnt; i++) {
+		if (msecs[i].shdr.type == SHT_GROUP)
+			finish_msec_group(&msecs[i], 1 + msec_cnt);
+	}
+	for (i = 0; i < msec_cnt; i++) {
+		shdr = msecs[i].shdr;
+		shdr.name_idx = add_str(&shstrs, msecs[i].name);
+		shdr.pos = out.size;
+		append(&out, msecs[i].data.ptr, msecs[i].data.size);
+		append(&shdrs, &shdr, sizeof(shdr));
+	}
+
+	loc_cnt = 1 + msec_cnt + m_locals.size / sizeof(Sym32);
+	symtab_idx = shdrs.size / sizeof(shdr);
+	memset(&shdr, 0, sizeof(shdr));
+	shdr.name_idx = add_str(&shstrs, ".symtab");
+	shdr.type = SHT_SYMTAB;
+	shdr.pos = out.size;
+	shdr.size = (loc_cnt + m_globals.size / sizeof(Sym32)) * sizeof(Sym32);
+	shdr.link = symtab_idx + 1;
+	shdr.info = loc_cnt;
+	shdr.align = 4;
+	shdr.ent_size = sizeof(Sym32);
+	append(&shdrs, &shdr, sizeof(shdr));
+	{
+		Sym32 sym = { 0 };
+		append(&out, &sym, sizeof(sym));
+		for (i = 0; i < msec_cnt; i++) {
+			sym.info = ST_INFO(STB_LOCAL, STT_SECTION);
+			sym.shdr_idx = i + 1;
+			append(&out, &sym, sizeof(sym));
+		}
+	}
+	append(&out, m_locals.ptr, m_locals.size);
+	append(&out, m_globals.ptr, m_globals.size);
+
+	memset(&shdr, 0, sizeof(shdr));
+	shdr.name_idx = add_str(&shstrs, ".strtab");
+	shdr.type = SHT_STRTAB;
+	shdr.pos = out.size;
+	shdr.size = m_strs.size;
+	shdr.align = 1;
+	append(&shdrs, &shdr, sizeof(shdr));
+	append(&out, m_strs.ptr, m_strs.size);
+
+	for (i = 0; i < msec_cnt; i++) {
+		char *name;
+		if (!msecs[i].rels.size)
+			continue;
+		name = malloc(strlen(msecs[i].name) + 5);
+		if (!name) error("out of memory");
+		sprintf(name, ".rel%s", msecs[i].name);
+		memset(&shdr, 0, sizeof(shdr));
+		shdr.name_idx = add_str(&shstrs, name);
+		shdr.type = SHT_REL;
+		shdr.flags = msecs[i].shdr.flags & SHF_GROUP;
+		shdr.pos = out.size;
+		shdr.size = msecs[i].rels.size;
+		shdr.link = symtab_idx;
+		shdr.info = i + 1;
+		shdr.align = 4;
+		shdr.ent_size = sizeof(Rel32);
+		append(&shdrs, &shdr, sizeof(shdr));
+		append(&out, msecs[i].rels.ptr, msecs[i].rels.size);
+		free(name);
+	}
+
+	memset(&shdr, 0, sizeof(shdr));
+	shdr.name_idx = add_str(&shstrs, ".shstrtab");
+	shdr.type = SHT_STRTAB;
+	shdr.pos = out.size;
+	shdr.size = shstrs.size;
+	shdr.align = 1;
+	append(&shdrs, &shdr, sizeof(shdr));
+	append(&out, shstrs.ptr, shstrs.size);
+
+	ehdr = ins[0].ehdr;
+	ehdr.shdr_pos = out.size;
+	ehdr.shdr_cnt = shdrs.size / sizeof(shdr);
+	ehdr.shdr_str_tbl_idx = ehdr.shdr_cnt - 1;
+	memcpy(out.ptr, &ehdr, sizeof(ehdr));
+	append(&out, shdrs.ptr, shdrs.size);
+
+	in_file = out;
 	if (!copy_and_check_ehdr())
-		error("%s: bad file", argv[1]);
+		error("merging failed");
+
+	for (i = 0; i < cnt; i++) {
+		free(ins[i].file.ptr);
+		free(ins[i].sec_map);
+		free(ins[i].sec_off);
+		free(ins[i].sym_map);
+		free(ins[i].discarded);
+	}
+	for (i = 0; i < msec_cnt; i++) {
+		free(msecs[i].data.ptr);
+		free(msecs[i].rels.ptr);
+	}
+	free(ins);
+	free(msecs);
+	free(m_locals.ptr);
+	free(m_globals.ptr);
+	free(m_strs.ptr);
+	free(shdrs.ptr);
+	free(shstrs.ptr);
+}
+
+
+
+// crossing analysis
+
+/*
+with -a (--analyze), nothing is written. instead, every call from
+the 32-bit code to a 64-bit function is listed, with the function
+it's made from, and ranked by how often it's likely to run. the
+estimate is crude: each loop around a call site is assumed to run
+10 times. loops are found by decoding the calling function and
+looking for backward jumps, so a call is inside a loop when it's
+between a jump and its target.
+*/
+
+int analyze;
+
+// whether the 0f-prefixed opcode has an 8-bit immediate
+int imm8_0f(u8 op) {
+	return (op >= 0x70 && op <= 0x73) || op == 0x0f || op == 0xa4 ||
+		op == 0xac || op == 0xba || op == 0xc2 || op == 0xc4 ||
+		op == 0xc5 || op == 0xc6;
+}
+
+// length of the i386 instruction at code, or 0 if it can't be decoded.
+// jumps with a relative target set *rel to it
+int insn_len(u8 *code, u32 size, int *is_jmp, int *rel) {
+	u32 i = 0, imm = 0, modrm = 0;
+	int opsize = 4, adsize = 4;
+	u8 op;
+
+	*is_jmp = 0;
+	for (;; i++) {
+		if (i >= size || i >= 15) return 0;
+		op = code[i];
+		if (op == 0x66) opsize = 2;
+		else if (op == 0x67) adsize = 2;
+		else if (op != 0xf0 && op != 0xf2 && op != 0xf3 && op != 0x26 &&
+		op != 0x2e && op != 0x36 && op != 0x3e && op != 0x64 && op != 0x65)
+			break;
+	}
+	i++;
+
+	if (op == 0x0f) {
+		if (i >= size) return 0;
+		op = code[i++];
+		if (op == 0x38) {
+			i++;
+			modrm = 1;
+		}
+		else if (op == 0x3a) {
+			i++;
+			modrm = 1;
+			imm = 1;
+		}
+		else if (op >= 0x80 && op <= 0x8f) {
+			// jcc rel32
+			*is_jmp = 1;
+			imm = opsize;
+		}
+		else if ((op >= 0x30 && op <= 0x37) || (op >= 0xc8 && op <= 0xcf) ||
+		op == 0x05 || op == 0x06 || op == 0x07 || op == 0x08 || op == 0x09 ||
+		op == 0x0b || op == 0x0e || op == 0x77 || op == 0xa0 || op == 0xa1 ||
+		op == 0xa2 || op == 0xa8 || op == 0xa9 || op == 0xaa) {
+		}
+		else {
+			modrm = 1;
+			imm = imm8_0f(op);
+		}
+	}
+	else if ((op == 0xc4 || op == 0xc5 || op == 0x62) && i < size && code[i] >= 0xc0) {
+		// vex and evex, the map comes from the first payload byte
+		// of the longer forms
+		int map = 1;
+		if (op == 0xc4) {
+			map = code[i] & 0x1f;
+			i++;
+		}
+		else if (op == 0x62) {
+			map = code[i] & 3;
+			i += 2;
+		}
+		i++;
+		if (i >= size) return 0;
+		op = code[i++];
+		// vzeroupper and vzeroall have no operands
+		modrm = map != 1 || op != 0x77;
+		if (map == 1) imm = imm8_0f(op);
+		else if (map == 3) imm = 1;
+	}
+	else if (op < 0x40) {
+		if ((op & 7) < 4) modrm = 1;
+		else if ((op & 7) == 4) imm = 1;
+		else if ((op & 7) == 5) imm = opsize;
+	}
+	else if (op < 0x60) {
+	}
+	else if (op >= 0x70 && op <= 0x7f) {
+		// jcc rel8
+		*is_jmp = 1;
+		imm = 1;
+	}
+	else if (op >= 0xb0 && op <= 0xb7) {
+		imm = 1;
+	}
+	else if (op >= 0xb8 && op <= 0xbf) {
+		imm = opsize;
+	}
+	else if (op >= 0xd8 && op <= 0xdf) {
+		// x87
+		modrm = 1;
+	}
+	else {
+		switch (op) {
+			case 0x62: case 0x63: case 0x84: case 0x85: case 0x86: case 0x87:
+			case 0x88: case 0x89: case 0x8a: case 0x8b: case 0x8c: case 0x8d:
+			case 0x8e: case 0x8f: case 0xc4: case 0xc5: case 0xd0: case 0xd1:
+			case 0xd2: case 0xd3: case 0xfe: case 0xff:
+				modrm = 1; break;
+			case 0x6b: case 0x80: case 0x82: case 0x83: case 0xc0: case 0xc1:
+			case 0xc6:
+				modrm = 1; imm = 1; break;
+			case 0x69: case 0x81: case 0xc7:
+				modrm = 1; imm = opsize; break;
+			case 0x6a: case 0xa8: case 0xcd: case 0xd4: case 0xd5: case 0xe4:
+			case 0xe5: case 0xe6: case 0xe7:
+				imm = 1; break;
+			case 0x68: case 0xa9: case 0xe8:
+				imm = opsize; break;
+			case 0xc2: case 0xca:
+				imm = 2; break;
+			case 0xc8:
+				imm = 3; break;
+			case 0x9a: case 0xea:
+				imm = opsize + 2; break;
+			case 0xa0: case 0xa1: case 0xa2: case 0xa3:
+				imm = adsize; break;
+			case 0xe0: case 0xe1: case 0xe2: case 0xe3: case 0xeb:
+				// loop, jcxz and jmp rel8
+				*is_jmp = 1; imm = 1; break;
+			case 0xe9:
+				*is_jmp = 1; imm = opsize; break;
+			case 0xf6: case 0xf7:
+				// only test has an immediate
+				if (i >= size) return 0;
+				modrm = 1;
+				if (!(code[i] & 0x30))
+					imm = op == 0xf6 ? 1 : opsize;
+				break;
+		}
+	}
+
+	if (modrm) {
+		u8 mod, rm;
+		if (i >= size) return 0;
+		mod = code[i] >> 6;
+		rm = code[i] & 7;
+		i++;
+		if (mod != 3 && adsize == 2) {
+			if (mod == 1) i += 1;
+			else if (mod == 2 || rm == 6) i += 2;
+		}
+		else if (mod != 3) {
+			if (rm == 4) {
+				if (i >= size) return 0;
+				if (mod == 0 && (code[i] & 7) == 5)
+					i += 4;
+				i++;
+			}
+			if (mod == 1) i += 1;
+			else if (mod == 2 || (mod == 0 && rm == 5)) i += 4;
+		}
+	}
+	if (i + imm > size) return 0;
+	if (*is_jmp) {
+		if (imm == 1) *rel = (signed char) code[i];
+		else if (imm == 2) *rel = (short) (code[i] | code[i + 1] << 8);
+		else memcpy(rel, code + i, 4);
+	}
+	return i + imm;
+}
+
+typedef struct Site Site;
+struct Site {
+	char *sec;
+	u32 offset;
+	char *fn;
+	u32 fn_offset;
+	char *callee;
+	int depth;
+};
+
+// number of loops in the function at [start, end) around the call at pos
+int loop_depth(u8 *code, u32 start, u32 end, u32 pos) {
+	u32 i = start;
+	int depth = 0;
+	while (i < end) {
+		int is_jmp;
+		int rel;
+		int len = insn_len(code + i, end - i, &is_jmp, &rel);
+		if (!len)
+			break;
+		// a backward jump closes a loop from its target to itself
+		if (is_jmp && rel < 0 && i + len + rel >= start &&
+		i + len + rel <= pos && pos < i + len)
+			depth++;
+		i += len;
+	}
+	return depth;
+}
+
+int cmp_sites(const void *a, const void *b) {
+	const Site *x = a, *y = b;
+	if (x->depth != y->depth)
+		return y->depth - x->depth;
+	if (strcmp(x->sec, y->sec))
+		return strcmp(x->sec, y->sec);
+	return x->offset < y->offset ? -1 : x->offset > y->offset;
+}
+
+// finds the function containing offset in section sec_idx
+Sym32 *find_containing_fn(Shdr32 *symtab, u32 sec_idx, u32 offset, Sym32 *out) {
+	u32 i;
+	for (i = 0; i < symtab->size / sizeof(Sym32); i++) {
+		get_sym(symtab, i, out);
+		if (out->shdr_idx == sec_idx && ST_TYPE(out->info) == STT_FUNC &&
+		out->val <= offset && offset < out->val + out->size)
+			return out;
+	}
+	return 0;
+}
+
+void analyze_crossings(void) {
+	Shdr32 shdr, target, symtab;
+	Site *sites = 0;
+	u32 site_cnt = 0, i, j;
+	int has_symtab = 0;
+
+	for (i = 0; i < in_ehdr.shdr_cnt; i++) {
+		get_shdr(i, &symtab);
+		if (symtab.type == SHT_SYMTAB) {
+			has_symtab = 1;
+			break;
+		}
+	}
+	if (!has_symtab)
+		error("no symbol table");
+
+	for (i = 0; i < in_ehdr.shdr_cnt; i++) {
+		get_shdr(i, &shdr);
+		if (shdr.type != SHT_REL)
+			continue;
+		get_shdr(shdr.info, &target);
+		if (!(target.flags & SHF_EXECINSTR) || target.type == SHT_NOBITS)
+			continue;
+		for (j = 0; j < shdr.size / sizeof(Rel32); j++) {
+			Rel32 rel;
+			Sym32 sym, fn;
+			Sig *sig;
+			Site *site;
+			u8 *code = (u8 *) in_file.ptr + target.pos;
+			char *name;
+
+			memcpy(&rel, in_file.ptr + shdr.pos + j * sizeof(rel), sizeof(rel));
+			if (R32_TYPE(rel.info) != R_386_PC32 && R32_TYPE(rel.info) != R_386_PLT32)
+				continue;
+			get_sym(&symtab, R32_SYM(rel.info), &sym);
+			name = sym_name(&symtab, &sym);
+			sig = find_fn(name);
+			// only calls to undefined functions with a stub cross
+			if (sym.shdr_idx || !sig || sig->builtin)
+				continue;
+			if (rel.offset < 1 || rel.offset + 4 > target.size)
+				continue;
+
+			sites = realloc(sites, (site_cnt + 1) * sizeof(Site));
+			if (!sites) error("out of memory");
+			site = &sites[site_cnt++];
+			site->sec = shdr_name(&target);
+			site->offset = rel.offset - 1;
+			site->callee = name;
+			site->fn = "?";
+			site->fn_offset = site->offset;
+			site->depth = 0;
+			if (find_containing_fn(&symtab, shdr.info, rel.offset, &fn)) {
+				site->fn = sym_name(&symtab, &fn);
+				site->fn_offset = site->offset - fn.val;
+				if (fn.val + fn.size <= target.size)
+					site->depth = loop_depth(code, fn.val, fn.val + fn.size,
+						site->offset);
+			}
+		}
+	}
+
+	qsort(sites, site_cnt, sizeof(Site), cmp_sites);
+	printf("%-10s %5s  %-24s %-20s %s\n",
+		"est. freq", "loops", "function", "section", "callee");
+	for (i = 0; i < site_cnt; i++) {
+		char fn[64], sec[64];
+		double freq = 1;
+		for (j = 0; j < sites[i].depth; j++)
+			freq *= 10;
+		snprintf(fn, sizeof(fn), "%s+0x%x", sites[i].fn, sites[i].fn_offset);
+		snprintf(sec, sizeof(sec), "%s+0x%x", sites[i].sec, sites[i].offset);
+		printf("%-10.0f %5d  %-24s %-20s %s\n", freq, sites[i].depth,
+			fn, sec, sites[i].callee);
+	}
+	free(sites);
+}
+
+
+
+// incremental conversion
+
+/*
+with -i old.o, conv first checks whether the previous output old.o
+would come out the same. every output has a .conv.sigs section
+(dropped by the linker), listing the crc of the conv binary, of the
+input, the options, and a hash of the signature of every function
+that got a stub. if the new list matches the one in old.o, the
+object isn't converted again: old.o is copied to the output (with
+copy_file_range, so it can share the blocks), or, if it is the
+output, only touched. so editing the flist only reconverts the
+objects using the functions that changed.
+*/
+
+char *old_out_name;
+
+u32 struct_hash(Struct *s) {
+	u32 crc = crc32(0, (u8 *) &s->field_cnt, sizeof(s->field_cnt));
+	return crc32(crc, (u8 *) s->field_type, s->field_cnt * sizeof(int));
+}
+
+// structs and callbacks are hashed by contents, not by their index
+u32 sig_hash(Sig *sig) {
+	Sig copy = *sig;
+	int i;
+	for (i = 0; i < 6; i++) {
+		if (copy.marshal[i].strct)
+			copy.marshal[i].strct = struct_hash(&structs[copy.marshal[i].strct - 1]);
+		if (copy.fnptr[i])
+			copy.fnptr[i] = sig_hash(&callbacks[copy.fnptr[i] - 1]);
+	}
+	return crc32(0, (u8 *) &copy, sizeof(copy));
+}
+
+void make_conv_sigs(Str *sigs) {
+	Shdr32 symtab;
+	Str exe;
+	char line[256];
+	u32 exe_crc = 0, i;
+
+	if (read_file(&exe, "/proc/self/exe", 0)) {
+		exe_crc = crc32(0, (u8 *) exe.ptr, exe.size);
+		free(exe.ptr);
+	}
+	snprintf(line, sizeof(line), "conv %08x in %08x -S %s%s%s%s%s%s\n", exe_crc,
+		(u32) crc32(0, (u8 *) in_file.ptr, in_file.size), switch_name[switch_kind],
+		strip_debug ? " -g" : "", strip_comment ? " -c" : "",
+		compress_debug ? " -z" : "", trace_stubs ? " -t" : "",
+		split_stubs ? " -f" : "");
+	append(sigs, line, strlen(line));
+
+	for (i = 0; i < in_ehdr.shdr_cnt; i++) {
+		u32 j;
+		get_shdr(i, &symtab);
+		if (symtab.type != SHT_SYMTAB)
+			continue;
+		for (j = 0; j < symtab.size / sizeof(Sym32); j++) {
+			Sym32 sym;
+			char *name;
+			Sig *sig;
+
+			get_sym(&symtab, j, &sym);
+			name = sym_name(&symtab, &sym);
+			sig = find_fn(name);
+			// the same functions conv_symtab makes stubs for
+			if (!sig || (sig->builtin && sym.shdr_idx))
+				continue;
+			if (sym.shdr_idx && (sym.info != ST_INFO(STB_GLOBAL, STT_FUNC) ||
+			!SHN_ISREAL(sym.shdr_idx)))
+				continue;
+			snprintf(line, sizeof(line), "%s %08x\n", name, sig_hash(sig));
+			append(sigs, line, strlen(line));
+		}
+	}
+}
+
+// finds the .conv.sigs section of an elf64 file
+int find_conv_sigs(Str *file, Shdr64 *shdr) {
+	Ehdr64 ehdr;
+	Shdr64 str_shdr;
+	u32 i;
+
+	if (file->size < sizeof(ehdr))
+		return 0;
+	memcpy(&ehdr, file->ptr, sizeof(ehdr));
+	if (memcmp(ehdr.ident, ELFMAG, 4) != 0 || ehdr.ident[EI_CLASS] != CLASS_64)
+		return 0;
+	if (ehdr.shdr_str_tbl_idx >= ehdr.shdr_cnt ||
+	ehdr.shdr_pos + (u64) ehdr.shdr_cnt * sizeof(Shdr64) > file->size)
+		return 0;
+	memcpy(&str_shdr, file->ptr + ehdr.shdr_pos + ehdr.shdr_str_tbl_idx * sizeof(Shdr64),
+		sizeof(str_shdr));
+	if (str_shdr.pos + str_shdr.size > file->size)
+		return 0;
+	for (i = 0; i < ehdr.shdr_cnt; i++) {
+		memcpy(shdr, file->ptr + ehdr.shdr_pos + i * sizeof(Shdr64), sizeof(*shdr));
+		if (shdr->name_idx >= str_shdr.size || shdr->pos + shdr->size > file->size)
+			continue;
+		if (strncmp(file->ptr + str_shdr.pos + shdr->name_idx, ".conv.sigs",
+		str_shdr.size - shdr->name_idx) == 0)
+			return 1;
+	}
+	return 0;
+}
+
+int is_up_to_date(char *old_name) {
+	Str old;
+	Shdr64 shdr;
+	int same;
+
+	if (!read_file(&old, old_name, 0))
+		return 0;
+	same = find_conv_sigs(&old, &shdr) && shdr.size == conv_sigs.size &&
+		memcmp(old.ptr + shdr.pos, conv_sigs.ptr, conv_sigs.size) == 0;
+	free(old.ptr);
+	return same;
+}
+
+void copy_file(char *from, char *to) {
+	struct stat st;
+	int in, out;
+	ssize_t n = 0;
+	loff_t left;
+
+	in = open(from, O_RDONLY);
+	if (in < 0 || fstat(in, &st) < 0)
+		error("%s: can't open", from);
+	out = open(to, O_WRONLY | O_CREAT | O_TRUNC, 0666);
+	if (out < 0)
+		error("%s: can't open", to);
+	for (left = st.st_size; left > 0; left -= n) {
+		n = copy_file_range(in, 0, out, 0, left, 0);
+		if (n <= 0)
+			break;
+	}
+	close(in);
+	close(out);
+	// not supported between these files, copy it the usual way
+	if (n < 0) {
+		Str data;
+		if (!read_file(&data, from, 0) || !write_file(&data, to))
+			error("%s: can't copy to %s", from, to);
+		free(data.ptr);
+	}
+}
+
+// reuses the old output if nothing changed, returns whether it did
+int reuse_old_out(char *out_name) {
+	struct stat old_st, out_st;
+
+	if (!is_up_to_date(old_out_name))
+		return 0;
+	if (stat(old_out_name, &old_st) == 0 && stat(out_name, &out_st) == 0 &&
+	old_st.st_dev == out_st.st_dev && old_st.st_ino == out_st.st_ino) {
+		// keep make from trying again
+		utime(out_name, 0);
+		return 1;
+	}
+	copy_file(old_out_name, out_name);
+	return 1;
+}
+
+
+
+void usage(char *prog) {
+	error("usage: %s [-g] [-c] [-f] [-t] [-z] [-S seq] [-i old] <in ET_REL>... <flist> <out ET_REL>\n"
+		"       %s -a <in ET_REL>... <flist>\n"
+		"  -a  list the calls into 64-bit code, most frequent first (--analyze)\n"
+		"  -g  drop the debug sections\n"
+		"  -c  drop the .comment section\n"
+		"  -f  put every stub in a section of its own\n"
+		"  -t  log every crossing, for trace.c\n"
+		"  -z  compress the debug sections\n"
+		"  -S  mode switch sequence: jmp (default), retf or far\n"
+		"  -i  reuse the old output if it would come out the same", prog, prog);
+}
+
+struct option long_opts[] = {
+	{ "analyze", no_argument, 0, 'a' },
+	{ 0 }
+};
+
+int main(int argc, char **argv) {
+	int i, opt, in_cnt;
+
+	while ((opt = getopt_long(argc, argv, "acfgtzS:i:", long_opts, 0)) != -1) {
+		switch (opt) {
+			case 'a': analyze = 1; break;
+			case 'i': old_out_name = optarg; break;
+			case 'g': strip_debug = 1; break;
+			case 'c': strip_comment = 1; break;
+			case 'f': split_stubs = 1; break;
+			case 't': trace_stubs = 1; break;
+			case 'z': compress_debug = 1; break;
+			case 'S':
+				for (i = 0; i < SWITCH_CNT; i++) {
+					if (strcmp(optarg, switch_name[i]) == 0)
+						break;
+				}
+				if (i == SWITCH_CNT)
+					error("unknown switch sequence: %s", optarg);
+				switch_kind = i;
+				break;
+			default: usage(argv[0]);
+		}
+	}
+	// there's no output file when analyzing
+	in_cnt = argc - optind - (analyze ? 1 : 2);
+	if (in_cnt < 1)
+		usage(argv[0]);
+
+	if (in_cnt == 1) {
+		if (!read_file(&in_file, argv[optind], 0))
+			error("%s: can't open", argv[optind]);
+		if (!copy_and_check_ehdr())
+			error("%s: bad file", argv[optind]);
+	}
+	else {
+		merge_inputs(argv + optind, in_cnt);
+	}
 	
-	if (!read_file(&flist_file, argv[2], 1))
-		error("%s: can't open", argv[2]);
+	if (!read_file(&flist_file, argv[optind + in_cnt], 1))
+		error("%s: can't open", argv[optind + in_cnt]);
 	parse_flist_file(&flist_file);
+	prepare_got();
+
+	if (analyze) {
+		analyze_crossings();
+		return 0;
+	}
+	make_conv_sigs(&conv_sigs);
+	if (old_out_name && reuse_old_out(argv[argc - 1]))
+		return 0;
 
 	new_shdr_idx = calloc(in_ehdr.shdr_cnt, sizeof(u16));
 	if (!new_shdr_idx)
 		error("out of memory");
-	for (i = 0; i < in_ehdr.shdr_cnt; i++)
+	for (i = 0; i < in_ehdr.shdr_cnt; i++) {
+		Shdr32 shdr;
+		memcpy(&shdr, in_file.ptr + in_ehdr.shdr_pos + i * sizeof(shdr), sizeof(shdr));
+		if (shdr.type == SHT_SYMTAB)
+			init_strtab(&sym_strs, shdr.link);
+	}
+	if (in_ehdr.shdr_str_tbl_idx && in_ehdr.shdr_str_tbl_idx != sym_strs.in_idx)
+		init_strtab(&sh_strs, in_ehdr.shdr_str_tbl_idx);
+	// the null section, then the groups, which precede their members
+	conv_shdr(0);
+	for (i = 1; i < in_ehdr.shdr_cnt; i++) {
+		Shdr32 shdr;
+		memcpy(&shdr, in_file.ptr + in_ehdr.shdr_pos + i * sizeof(shdr), sizeof(shdr));
+		if (shdr.type == SHT_GROUP)
+			conv_shdr(i);
+	}
+	for (i = 1; i < in_ehdr.shdr_cnt; i++)
 		conv_shdr(i);
+	finish_groups();
+	finish_strtab(&sym_strs);
+	finish_strtab(&sh_strs);
 	conv_ehdr();
 
 	append(&out_file, &out_ehdr, sizeof(out_ehdr));
 	append(&out_file, out_sections.ptr, out_sections.size);
 	append(&out_file, out_shdr_tbl.ptr, out_shdr_tbl.size);
 
-	write_file(&out_file, argv[3]);
+	write_file(&out_file, argv[argc - 1]);
 
 	free(in_file.ptr);
 	free(flist_file.ptr);
@@ -861,6 +4317,12 @@ int main(int argc, char **argv) {
 
 	free(new_shdr_idx);
 	free(copied_sym_idx);
+	free(sym_strs.strs.ptr);
+	free(sh_strs.strs.ptr);
+	free(stub_relas.ptr);
+	free(conv_sigs.ptr);
+	free(stub_pieces.ptr);
+	free(got_ents.ptr);
 
 	return 0;
 }
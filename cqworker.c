@@ -0,0 +1,48 @@
+#include "queue.h"
+
+/*
+the worker loop. this is compiled as 32-bit code and converted like
+any other, so the 64-bit side enters it once through its stub and
+from then on every call is a plain 32-bit call.
+*/
+
+typedef unsigned (*Fn32)(unsigned, unsigned, unsigned, unsigned, unsigned, unsigned);
+
+static void yield(void) {
+	// sched_yield, through the 32-bit syscall interface
+	int ret;
+	__asm__ volatile ("int $0x80" : "=a"(ret) : "a"(158) : "memory");
+}
+
+void cq_worker(Cq *q) {
+	unsigned pos = q->head;
+	unsigned *a;
+	CqCell *c;
+	int spins;
+
+	for (;;) {
+		c = &q->cells[pos & (CQ_SIZE - 1)];
+		spins = 0;
+		while (__atomic_load_n(&c->seq, __ATOMIC_ACQUIRE) != pos + 1) {
+			if (++spins < 1000) {
+				__builtin_ia32_pause();
+			}
+			else {
+				yield();
+				spins = 0;
+			}
+		}
+
+		// a call to null stops the worker
+		if (!c->fn) {
+			__atomic_store_n(&c->seq, pos + 2, __ATOMIC_RELEASE);
+			q->head = pos + 1;
+			return;
+		}
+
+		a = c->args;
+		c->ret = ((Fn32) c->fn)(a[0], a[1], a[2], a[3], a[4], a[5]);
+		__atomic_store_n(&c->seq, pos + 2, __ATOMIC_RELEASE);
+		q->head = ++pos;
+	}
+}
@@ -0,0 +1,11 @@
+// bitwise crc32, a compute-heavy kernel with a single crossing
+unsigned crc_buf(unsigned char *buf, int len) {
+	unsigned crc = ~0u;
+	int i;
+	while (len--) {
+		crc ^= *buf++;
+		for (i = 0; i < 8; i++)
+			crc = (crc >> 1) ^ (0xedb88320 & -(crc & 1));
+	}
+	return ~crc;
+}
@@ -15,12 +15,15 @@ typedef signed   long long s64;
 #define DATA_LE  1
 #define DATA_BE  2
 
-#define ET_REL 1
+#define ET_REL  1
+#define ET_EXEC 2
 
 #define EM_386    3
 #define EM_X86_64 62
 
 #define SHN_LORESERVE 0xff00
+#define SHN_ABS       0xfff1
+#define SHN_COMMON    0xfff2
 
 #define SHT_NULL     0
 #define SHT_PROGBITS 1
@@ -28,11 +31,21 @@ typedef signed   long long s64;
 #define SHT_STRTAB   3
 #define SHT_RELA     4
 #define SHT_NOTE     7
+#define SHT_NOBITS   8
 #define SHT_REL      9
+#define SHT_GROUP    17
+#define SHT_X86_64_UNWIND 0x70000001
 
 #define SHF_WRITE (1 << 0)
 #define SHF_ALLOC (1 << 1)
 #define SHF_EXECINSTR (1 << 2)
+#define SHF_GROUP (1 << 9)
+#define SHF_COMPRESSED (1 << 11)
+#define SHF_EXCLUDE (1u << 31)
+
+#define ELFCOMPRESS_ZLIB 1
+
+#define GRP_COMDAT 1
 
 #define ST_BIND(info) ((info) >> 4)
 #define ST_TYPE(info) ((info) & 0xf)
@@ -40,7 +53,10 @@ typedef signed   long long s64;
 
 #define STB_LOCAL  0 
 #define STB_GLOBAL 1
+#define STB_WEAK   2
 
+#define STT_NOTYPE  0
+#define STT_OBJECT  1
 #define STT_FUNC    2
 #define STT_SECTION 3
 
@@ -52,12 +68,17 @@ typedef signed   long long s64;
 #define R64_TYPE(info) ((info) & 0xffffffff)
 #define R64_INFO(sym, type) (((u64) (sym)) << 32 | type)
 
-#define R_386_32    1
-#define R_386_PC32  2
-#define R_386_PLT32 4
+#define R_386_32     1
+#define R_386_PC32   2
+#define R_386_GOT32  3
+#define R_386_PLT32  4
+#define R_386_GOTOFF 9
+#define R_386_GOTPC  10
+#define R_386_GOT32X 43
 
 #define R_X86_64_PC32 2
 #define R_X86_64_32   10
+#define R_X86_64_32S  11
 
 typedef struct Ehdr32 Ehdr32;
 struct Ehdr32 {
@@ -123,6 +144,21 @@ struct Shdr64 {
 	u64 ent_size;
 };
 
+typedef struct Chdr32 Chdr32;
+struct Chdr32 {
+	u32 type;
+	u32 size;
+	u32 align;
+};
+
+typedef struct Chdr64 Chdr64;
+struct Chdr64 {
+	u32 type;
+	u32 reserved;
+	u64 size;
+	u64 align;
+};
+
 typedef struct Sym32 Sym32;
 struct Sym32 {
 	u32 name_idx;
@@ -0,0 +1,5 @@
+// renames the kernels, so the native builds can be linked next to the converted ones
+#define shuffle native_shuffle
+#define ping native_ping
+#define pong native_pong
+#define crc_buf native_crc_buf
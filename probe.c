@@ -0,0 +1,63 @@
+#include <stdio.h>
+#include <time.h>
+#include <sys/mman.h>
+
+/*
+times the crossings of calls.c converted with one switch sequence.
+prints the average cost of a crossing in ns, see the probe target
+in the makefile.
+*/
+
+#define N    100000
+#define RUNS 5
+
+extern int ping(int x);
+extern int pong(int x, int n);
+
+// called back by pong
+int next(int x) {
+	return x + 1;
+}
+
+double now(void) {
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1e9 + ts.tv_nsec;
+}
+
+int real_main(void) {
+	double best = 0, t;
+	int i, r, x = 0;
+
+	for (r = 0; r < RUNS; r++) {
+		t = now();
+		for (i = 0; i < N; i++)
+			x = ping(x);
+		x = pong(x, N);
+		t = (now() - t) / (2 * N);
+		if (!r || t < best)
+			best = t;
+	}
+	printf("%.2f\n", best);
+	return x < 0;
+}
+
+__asm__(
+	"call_with_stack:\n"
+	"pushq %rbp\n"
+	"movq %rsp, %rbp\n"
+	"movq %rdi, %rsp\n"
+	"call real_main\n"
+	"movq %rbp, %rsp\n"
+	"popq %rbp\n"
+	"ret\n"
+);
+
+int call_with_stack(void *ptr);
+
+int main() {
+	void *stack = mmap(0, 0x10000,
+		PROT_READ | PROT_WRITE,
+		MAP_PRIVATE | MAP_ANONYMOUS | MAP_32BIT, -1, 0);
+	return call_with_stack(stack + 0x10000);
+}
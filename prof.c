@@ -0,0 +1,400 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <signal.h>
+#include <dlfcn.h>
+#include <ucontext.h>
+#include <unwind.h>
+#include <sys/mman.h>
+#include <sys/time.h>
+#include "elf.h"
+
+/*
+sampling profiler for executables with converted code. on every
+SIGPROF it notes whether the thread was in 32-bit code (cs is 0x23
+there), in a stub (the __conv_g2c_, __conv_c2g_ and __conv_thunks
+symbols conv makes cover the stub section) or in 64-bit code, and
+the call stack. at exit the samples are written as folded stacks,
+for flamegraph.pl, each rooted at its mode:
+	[32-bit];__conv_g2c_shuffle;shuffle 120
+
+64-bit frames (and the stubs) are walked with the unwind info. the
+32-bit ones have none, so the stack is searched for return addresses
+instead, up to the stub the 32-bit code was entered from; the frames
+above that stub aren't recovered.
+
+link this file into the executable (built -no-pie, like everything
+using converted code), or make prof.so and preload it, and set
+CONV_PROF to the file to write, and CONV_PROF_HZ to the sample rate
+(at most MAX_HZ, the timer counts in microseconds).
+*/
+
+#define MAX_SAMPLES 65536
+#define MAX_DEPTH   64
+#define DEFAULT_HZ  1000
+#define MAX_HZ      100000
+// how far up the 32-bit stack return addresses are looked for
+#define SCAN_SIZE   65536
+
+#define CS_32 0x23
+
+enum {
+	MODE_64,
+	MODE_32,
+	MODE_STUB,
+	MODE_CNT,
+};
+
+char *mode_name[] = {
+	"[64-bit]",
+	"[32-bit]",
+	"[stub]",
+};
+
+typedef struct Sample Sample;
+struct Sample {
+	int done;
+	int mode;
+	int depth;
+	// leaf first, return addresses minus 1, so they fall in the call
+	u64 ip[MAX_DEPTH];
+};
+
+Sample *samples;
+unsigned sample_cnt;
+
+typedef struct Fn Fn;
+struct Fn {
+	u64 start;
+	u64 end;
+	char *name;
+	int stub;
+	int rank;
+};
+
+Fn *fns;
+int fn_cnt;
+
+FILE *prof_fp;
+
+// the stub markers first, then plain names, then __conv32_ aliases
+int name_rank(char *name) {
+	if (strncmp(name, "__conv_", 7) == 0)
+		return 2;
+	return strncmp(name, "__conv32_", 9) != 0;
+}
+
+int cmp_fns(const void *a, const void *b) {
+	const Fn *x = a, *y = b;
+	if (x->start != y->start)
+		return x->start < y->start ? -1 : 1;
+	return y->rank - x->rank;
+}
+
+// the function symbols of the executable, sorted, one per address
+int load_fns(void) {
+	FILE *fp = fopen("/proc/self/exe", "rb");
+	Ehdr64 *ehdr;
+	Shdr64 *shdr;
+	char *file;
+	long size;
+	int i, j;
+
+	if (!fp)
+		return 0;
+	fseek(fp, 0, SEEK_END);
+	size = ftell(fp);
+	rewind(fp);
+	file = malloc(size);
+	if (!file || fread(file, 1, size, fp) != size) {
+		fclose(fp);
+		free(file);
+		return 0;
+	}
+	fclose(fp);
+
+	ehdr = (Ehdr64 *) file;
+	if (ehdr->type != ET_EXEC) {
+		fprintf(stderr, "conv prof: the executable must be built -no-pie\n");
+		free(file);
+		return 0;
+	}
+	shdr = (Shdr64 *) (file + ehdr->shdr_pos);
+	for (i = 0; i < ehdr->shdr_cnt; i++) {
+		Sym64 *syms = (Sym64 *) (file + shdr[i].pos);
+		char *strs = file + shdr[shdr[i].link].pos;
+		int cnt = shdr[i].size / sizeof(Sym64);
+		if (shdr[i].type != SHT_SYMTAB)
+			continue;
+		fns = malloc(cnt * sizeof(Fn));
+		if (!fns) {
+			free(file);
+			return 0;
+		}
+		for (j = 0; j < cnt; j++) {
+			Fn *fn = &fns[fn_cnt];
+			char *name = strs + syms[j].name_idx;
+			if (ST_TYPE(syms[j].info) != STT_FUNC || !syms[j].shdr_idx || !syms[j].size)
+				continue;
+			fn->start = syms[j].val;
+			fn->end = syms[j].val + syms[j].size;
+			fn->name = name;  // points into file, which is kept
+			fn->stub = strncmp(name, "__conv_g2c_", 11) == 0 ||
+				strncmp(name, "__conv_c2g_", 11) == 0 ||
+				strcmp(name, "__conv_thunks") == 0;
+			fn->rank = name_rank(name);
+			fn_cnt++;
+		}
+		break;
+	}
+	if (!fn_cnt) {
+		fprintf(stderr, "conv prof: no symbols\n");
+		free(fns);
+		fns = 0;
+		free(file);
+		return 0;
+	}
+	qsort(fns, fn_cnt, sizeof(Fn), cmp_fns);
+	for (i = 1, j = 1; i < fn_cnt; i++) {
+		if (fns[i].start != fns[j - 1].start)
+			fns[j++] = fns[i];
+	}
+	fn_cnt = j;
+	return 1;
+}
+
+Fn *find_fn(u64 ip) {
+	int lo = 0, hi = fn_cnt;
+	while (hi - lo > 1) {
+		int mid = (lo + hi) / 2;
+		if (fns[mid].start <= ip)
+			lo = mid;
+		else
+			hi = mid;
+	}
+	if (ip < fns[lo].start || ip >= fns[lo].end)
+		return 0;
+	return &fns[lo];
+}
+
+// whether ra follows a call: call rel32, or call through a register or memory
+int after_call(u64 ra, Fn *fn) {
+	static int call_size[] = { 2, 3, 4, 6, 7 };
+	u8 *code = (u8 *) ra;
+	int i;
+
+	if (ra - 5 >= fn->start && code[-5] == 0xe8)
+		return 1;
+	for (i = 0; i < sizeof(call_size) / sizeof(call_size[0]); i++) {
+		int k = call_size[i];
+		if (ra - k >= fn->start && code[-k] == 0xff && (code[1 - k] & 0x38) == 0x10)
+			return 1;
+	}
+	return 0;
+}
+
+int is_mapped(void *page) {
+	unsigned char vec;
+	return mincore(page, 1, &vec) == 0;
+}
+
+// searches the 32-bit stack from sp for return addresses
+void scan_stack(Sample *s, u64 sp) {
+	u32 *p, *end = (u32 *) (sp + SCAN_SIZE);
+	Fn *fn;
+
+	for (p = (u32 *) sp; p < end && s->depth < MAX_DEPTH; p++) {
+		if ((p == (u32 *) sp || !((u64) p & 0xfff)) &&
+		!is_mapped((void *) ((u64) p & ~0xfffull)))
+			break;
+		if (!(fn = find_fn(*p)) || !after_call(*p, fn))
+			continue;
+		s->ip[s->depth++] = *p - 1;
+		if (fn->stub)
+			break;
+	}
+}
+
+typedef struct Walk Walk;
+struct Walk {
+	Sample *s;
+	u64 ip;
+	int started;
+	// the stack pointer of the caller of the last frame
+	u64 cfa;
+};
+
+_Unwind_Reason_Code walk_frame(struct _Unwind_Context *ctx, void *arg) {
+	Walk *w = arg;
+	int exact;
+	u64 ip = _Unwind_GetIPInfo(ctx, &exact);
+
+	// skips the handler and the signal frame, the interrupted ip is known
+	if (!w->started) {
+		w->started = ip == w->ip;
+		return _URC_NO_REASON;
+	}
+	if (!ip || w->s->depth == MAX_DEPTH)
+		return _URC_END_OF_STACK;
+	w->s->ip[w->s->depth++] = exact ? ip : ip - 1;
+	w->cfa = _Unwind_GetCFA(ctx);
+	return _URC_NO_REASON;
+}
+
+/*
+the unwinder stops in the 32-bit code that called a 64-bit
+function, as it has no unwind info. the stack of that code is
+then searched, starting where the stub's return address was.
+*/
+void walk_stack(Sample *s, u64 ip) {
+	Walk w = { s, ip };
+	Fn *fn;
+
+	_Unwind_Backtrace(walk_frame, &w);
+	if (s->depth < 2 || s->depth == MAX_DEPTH)
+		return;
+	fn = find_fn(s->ip[s->depth - 2]);
+	if (fn && fn->stub && strncmp(fn->name, "__conv_g2c_", 11) != 0)
+		scan_stack(s, w.cfa);
+}
+
+void on_sigprof(int sig, siginfo_t *info, void *ptr) {
+	ucontext_t *uc = ptr;
+	u64 ip = uc->uc_mcontext.gregs[REG_RIP];
+	u64 sp = uc->uc_mcontext.gregs[REG_RSP];
+	int cs = uc->uc_mcontext.gregs[REG_CSGSFS] & 0xffff;
+	unsigned i = __atomic_fetch_add(&sample_cnt, 1, __ATOMIC_RELAXED);
+	Sample *s;
+	Fn *fn;
+
+	if (i >= MAX_SAMPLES)
+		return;
+	s = &samples[i];
+	fn = find_fn(ip);
+	s->mode = fn && fn->stub ? MODE_STUB : cs == CS_32 ? MODE_32 : MODE_64;
+	s->ip[0] = ip;
+	s->depth = 1;
+	// the 32-bit part of a stub is only the switch, it has nothing to walk
+	if (cs != CS_32)
+		walk_stack(s, ip);
+	else if (!fn || !fn->stub)
+		scan_stack(s, sp);
+	__atomic_store_n(&s->done, 1, __ATOMIC_RELEASE);
+}
+
+_Unwind_Reason_Code no_frame(struct _Unwind_Context *ctx, void *arg) {
+	return _URC_END_OF_STACK;
+}
+
+int conv_prof_start(char *path, int hz) {
+	struct sigaction sa;
+	struct itimerval it;
+
+	// a zero interval would disarm the timer
+	if (hz < 1)
+		hz = DEFAULT_HZ;
+	if (hz > MAX_HZ)
+		hz = MAX_HZ;
+	it.it_interval.tv_sec = 0;
+	it.it_interval.tv_usec = 1000000 / hz;
+	it.it_value = it.it_interval;
+
+	if (!load_fns())
+		return 0;
+	samples = mmap(0, MAX_SAMPLES * sizeof(Sample), PROT_READ | PROT_WRITE,
+		MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+	if (samples == MAP_FAILED)
+		return 0;
+	prof_fp = fopen(path, "w");
+	if (!prof_fp)
+		return 0;
+	// the unwinder sets itself up on first use, not in the handler then
+	_Unwind_Backtrace(no_frame, 0);
+
+	memset(&sa, 0, sizeof(sa));
+	sa.sa_sigaction = on_sigprof;
+	sa.sa_flags = SA_SIGINFO | SA_RESTART;
+	sigemptyset(&sa.sa_mask);
+	sigaction(SIGPROF, &sa, 0);
+	setitimer(ITIMER_PROF, &it, 0);
+	return 1;
+}
+
+int cmp_lines(const void *a, const void *b) {
+	return strcmp(*(char **) a, *(char **) b);
+}
+
+// the executable's symbols first, then the dynamic ones of the libraries
+char *frame_name(u64 ip, char *buf, int size) {
+	Fn *fn = find_fn(ip);
+	Dl_info info;
+
+	if (fn)
+		return fn->name;
+	if (dladdr((void *) ip, &info) && info.dli_sname)
+		return (char *) info.dli_sname;
+	snprintf(buf, size, "0x%llx", ip);
+	return buf;
+}
+
+// the folded stack of a sample, outermost frame first
+char *fold(Sample *s) {
+	char line[8192], buf[32];
+	int i, len;
+
+	len = snprintf(line, sizeof(line), "%s", mode_name[s->mode]);
+	for (i = s->depth - 1; i >= 0 && len < sizeof(line); i--) {
+		len += snprintf(line + len, sizeof(line) - len, ";%s",
+			frame_name(s->ip[i], buf, sizeof(buf)));
+	}
+	return strdup(line);
+}
+
+void conv_prof_stop(void) {
+	struct itimerval it = { { 0, 0 }, { 0, 0 } };
+	unsigned cnt = sample_cnt < MAX_SAMPLES ? sample_cnt : MAX_SAMPLES;
+	unsigned mode_cnt[MODE_CNT] = { 0 };
+	unsigned i, j, n = 0;
+	char **lines;
+
+	if (!prof_fp)
+		return;
+	setitimer(ITIMER_PROF, &it, 0);
+	signal(SIGPROF, SIG_IGN);
+
+	lines = malloc((cnt + 1) * sizeof(char *));
+	for (i = 0; lines && i < cnt; i++) {
+		if (!__atomic_load_n(&samples[i].done, __ATOMIC_ACQUIRE))
+			continue;
+		mode_cnt[samples[i].mode]++;
+		if ((lines[n] = fold(&samples[i])))
+			n++;
+	}
+	qsort(lines, n, sizeof(char *), cmp_lines);
+	for (i = 0; i < n; i = j) {
+		for (j = i + 1; j < n && strcmp(lines[i], lines[j]) == 0; j++)
+			free(lines[j]);
+		fprintf(prof_fp, "%s %u\n", lines[i], j - i);
+		free(lines[i]);
+	}
+	free(lines);
+	fclose(prof_fp);
+	prof_fp = 0;
+
+	if (n) {
+		fprintf(stderr, "conv prof: %u samples, 64-bit %.1f%%, 32-bit %.1f%%, stubs %.1f%%\n",
+			n, 100.0 * mode_cnt[MODE_64] / n, 100.0 * mode_cnt[MODE_32] / n,
+			100.0 * mode_cnt[MODE_STUB] / n);
+	}
+	if (sample_cnt > MAX_SAMPLES)
+		fprintf(stderr, "conv prof: %u samples dropped\n", sample_cnt - MAX_SAMPLES);
+}
+
+__attribute__((constructor))
+void conv_prof_init(void) {
+	char *path = getenv("CONV_PROF");
+	char *hz = getenv("CONV_PROF_HZ");
+	if (path && conv_prof_start(path, hz ? atoi(hz) : DEFAULT_HZ))
+		atexit(conv_prof_stop);
+}
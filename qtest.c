@@ -0,0 +1,41 @@
+#include <stdio.h>
+#include <stdint.h>
+#include <sys/mman.h>
+#include "queue.h"
+
+#define N 10
+#define CALLS 4
+
+// the 32-bit entry of shuffle, exported by conv
+extern char __conv32_shuffle[];
+
+int main() {
+	unsigned tickets[CALLS];
+	int (*arr)[N];
+	Cq *q;
+	int i, j;
+
+	// the arrays are passed to 32-bit code, so they go into low memory
+	arr = mmap(0, CALLS * sizeof(*arr),
+		PROT_READ | PROT_WRITE,
+		MAP_PRIVATE | MAP_ANONYMOUS | MAP_32BIT, -1, 0);
+	q = cq_start();
+	if (arr == MAP_FAILED || !q)
+		return 1;
+
+	for (i = 0; i < CALLS; i++) {
+		for (j = 0; j < N; j++)
+			arr[i][j] = j;
+		tickets[i] = cq_submit(q, __conv32_shuffle, 2,
+			(unsigned) (uintptr_t) arr[i], N);
+	}
+	for (i = 0; i < CALLS; i++) {
+		cq_wait(q, tickets[i]);
+		for (j = 0; j < N; j++)
+			printf("%d ", arr[i][j]);
+		printf("\n");
+	}
+
+	cq_stop(q);
+	return 0;
+}
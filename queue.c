@@ -0,0 +1,118 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdarg.h>
+#include <stdint.h>
+#include <pthread.h>
+#include <sys/mman.h>
+#include "queue.h"
+
+// the stub for the 32-bit worker loop, from cqworker64.o
+extern void cq_worker(Cq *q);
+
+#define CQ_STACK_SIZE 0x40000
+
+typedef struct CqThread CqThread;
+struct CqThread {
+	Cq q;
+	pthread_t thread;
+	void *mem;
+};
+
+static void *worker_main(void *arg) {
+	cq_worker(arg);
+	return 0;
+}
+
+/*
+the queue and the worker's stack have to be reachable from
+32-bit code, so they both go into one MAP_32BIT mapping.
+*/
+Cq *cq_start(void) {
+	pthread_attr_t attr;
+	CqThread *t;
+	char *mem;
+	int i;
+
+	mem = mmap(0, sizeof(CqThread) + CQ_STACK_SIZE,
+		PROT_READ | PROT_WRITE,
+		MAP_PRIVATE | MAP_ANONYMOUS | MAP_32BIT, -1, 0);
+	if (mem == MAP_FAILED)
+		return 0;
+	t = (CqThread *) (mem + CQ_STACK_SIZE);
+	t->mem = mem;
+	for (i = 0; i < CQ_SIZE; i++)
+		t->q.cells[i].seq = i;
+
+	pthread_attr_init(&attr);
+	pthread_attr_setstack(&attr, mem, CQ_STACK_SIZE);
+	if (pthread_create(&t->thread, &attr, worker_main, &t->q)) {
+		munmap(mem, sizeof(CqThread) + CQ_STACK_SIZE);
+		t = 0;
+	}
+	pthread_attr_destroy(&attr);
+	return t ? &t->q : 0;
+}
+
+void cq_stop(Cq *q) {
+	CqThread *t = (CqThread *) q;
+	cq_wait(q, cq_submit(q, 0, 0));
+	pthread_join(t->thread, 0);
+	munmap(t->mem, sizeof(CqThread) + CQ_STACK_SIZE);
+}
+
+/*
+fn is the 32-bit entry of the function, so for a converted
+function foo it's __conv32_foo, not foo (which is the stub).
+*/
+unsigned cq_submit(Cq *q, void *fn, int argc, ...) {
+	unsigned pos, seq;
+	CqCell *c;
+	va_list ap;
+	int i;
+
+	if ((uintptr_t) fn >> 32 || argc > CQ_MAX_ARGS) {
+		fprintf(stderr, "cq_submit: bad call\n");
+		abort();
+	}
+
+	pos = __atomic_load_n(&q->tail, __ATOMIC_RELAXED);
+	for (;;) {
+		c = &q->cells[pos & (CQ_SIZE - 1)];
+		seq = __atomic_load_n(&c->seq, __ATOMIC_ACQUIRE);
+		if (seq == pos) {
+			if (__atomic_compare_exchange_n(&q->tail, &pos, pos + 1, 1,
+			__ATOMIC_RELAXED, __ATOMIC_RELAXED))
+				break;
+		}
+		else {
+			// full, or another producer got here first
+			if ((int) (seq - pos) < 0)
+				__builtin_ia32_pause();
+			pos = __atomic_load_n(&q->tail, __ATOMIC_RELAXED);
+		}
+	}
+
+	c->fn = (uintptr_t) fn;
+	va_start(ap, argc);
+	for (i = 0; i < CQ_MAX_ARGS; i++)
+		c->args[i] = i < argc ? va_arg(ap, unsigned) : 0;
+	va_end(ap);
+	__atomic_store_n(&c->seq, pos + 1, __ATOMIC_RELEASE);
+	return pos;
+}
+
+int cq_done(Cq *q, unsigned ticket) {
+	CqCell *c = &q->cells[ticket & (CQ_SIZE - 1)];
+	return __atomic_load_n(&c->seq, __ATOMIC_ACQUIRE) == ticket + 2;
+}
+
+unsigned cq_wait(Cq *q, unsigned ticket) {
+	CqCell *c = &q->cells[ticket & (CQ_SIZE - 1)];
+	unsigned ret;
+
+	while (!cq_done(q, ticket))
+		__builtin_ia32_pause();
+	ret = c->ret;
+	__atomic_store_n(&c->seq, ticket + CQ_SIZE, __ATOMIC_RELEASE);
+	return ret;
+}
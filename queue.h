@@ -0,0 +1,46 @@
+/*
+an asynchronous call queue serviced by a worker thread which stays
+in 32-bit mode. 64-bit threads submit calls to 32-bit functions and
+get a ticket back, which they later wait on. nothing on the caller
+side switches modes; the worker only switches once, when it starts.
+
+the queue lives in low memory and is shared by both modes, so it
+only contains 32-bit fields. a call takes up to 6 32-bit argument
+words (a long long argument takes two) and returns eax.
+
+the ring is a bounded mpsc queue. every cell has a sequence number:
+	pos      - free, can be claimed by the producer at pos
+	pos + 1  - submitted, waiting for the worker
+	pos + 2  - done, waiting for the producer to collect the result
+the producer releases the cell (pos + CQ_SIZE) once it has the result,
+so every ticket has to be waited on.
+*/
+
+#define CQ_SIZE 256
+#define CQ_MAX_ARGS 6
+
+typedef struct CqCell CqCell;
+struct CqCell {
+	unsigned seq;
+	unsigned fn;
+	unsigned args[CQ_MAX_ARGS];
+	unsigned ret;
+	unsigned pad[7];
+};
+
+typedef struct Cq Cq;
+struct Cq {
+	unsigned head;
+	unsigned pad1[15];
+	unsigned tail;
+	unsigned pad2[15];
+	CqCell cells[CQ_SIZE];
+};
+
+#ifdef __x86_64__
+Cq *cq_start(void);
+void cq_stop(Cq *q);
+unsigned cq_submit(Cq *q, void *fn, int argc, ...);
+int cq_done(Cq *q, unsigned ticket);
+unsigned cq_wait(Cq *q, unsigned ticket);
+#endif
@@ -0,0 +1,30 @@
+/*
+built with -mregparm=3, so every function here, and every function
+it calls, takes its first three integer words in eax, edx and ecx
+unless it says otherwise. rptest.c calls these from 64-bit code.
+*/
+
+#define FASTCALL __attribute__((fastcall))
+
+long long offset(long long x, int k);
+FASTCALL int weight(int a, int b, int c);
+
+long long mix(int a, long long b, int c, double d) {
+	return offset(a + b, c) + (int) d;
+}
+
+__attribute__((regparm(1))) int first(int a, int b, float c) {
+	return a - b + (int) (c * 2);
+}
+
+FASTCALL int dot(int a, int b, int c, int d) {
+	return weight(a, b, 3) + c * d;
+}
+
+int fold(int *arr, int n, int init, FASTCALL int (*fn)(int, int, int)) {
+	int i;
+
+	for (i = 0; i < n; i++)
+		init = fn(init, arr[i], i);
+	return init;
+}
@@ -0,0 +1,53 @@
+#include <stdio.h>
+#include <sys/mman.h>
+
+extern long long mix(int a, long long b, int c, double d);
+extern int first(int a, int b, float c);
+extern int dot(int a, int b, int c, int d);
+extern int fold(int *arr, int n, int init, int (*fn)(int, int, int));
+
+// called by rp.c, as regparm(3) and fastcall functions
+long long offset(long long x, int k) {
+	return x * k;
+}
+
+int weight(int a, int b, int c) {
+	return a * c - b;
+}
+
+int step(int acc, int x, int i) {
+	return acc * 3 + x - i;
+}
+
+int real_main(void) {
+	int arr[] = { 4, -1, 7, 2, 9 };
+
+	printf("%lld\n", mix(-3, 0x100000000ll, 5, 2.75));
+	printf("%d\n", first(10, 4, 1.5f));
+	printf("%d\n", dot(6, 2, -3, 7));
+	printf("%d\n", fold(arr, 5, 1, step));
+	// the callback keeps its thunk
+	printf("%d\n", fold(arr, 3, 0, step));
+
+	return 0;
+}
+
+__asm__(
+	"call_with_stack:\n"
+	"pushq %rbp\n"
+	"movq %rsp, %rbp\n"
+	"movq %rdi, %rsp\n"
+	"call real_main\n"
+	"movq %rbp, %rsp\n"
+	"popq %rbp\n"
+	"ret\n"
+);
+
+int call_with_stack(void *ptr);
+
+int main() {
+	void *stack = mmap(0, 0x10000,
+		PROT_READ | PROT_WRITE,
+		MAP_PRIVATE | MAP_ANONYMOUS | MAP_32BIT, -1, 0);
+	return call_with_stack(stack + 0x10000);
+}
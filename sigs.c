@@ -0,0 +1,25 @@
+/*
+a function of each return type, called from 64-bit code and calling
+into it. make stubcheck keeps track of the stubs conv makes for them.
+*/
+
+float fscale(float x, int k);
+double dmix(double a, double b, int k);
+long long lladd(long long a, long long b);
+long lclamp(long x, long lo, long hi);
+
+float ftwice(float x) {
+	return fscale(x, 2);
+}
+
+double dhalf(double a, double b) {
+	return dmix(a, b, 2);
+}
+
+long long llsum(long long a, int b) {
+	return lladd(a, b);
+}
+
+long lsign(long x) {
+	return lclamp(x, -1, 1);
+}
@@ -0,0 +1,282 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <stddef.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+
+/*
+runtime for the stubs made by conv -t. each stub calls
+__conv_trace_enter before crossing to the other mode, and
+__conv_trace_exit after coming back, with the address of its
+name pushed on the stack. these only append an event (rdtsc and
+the name) to the thread's ring, and drop it if the ring is full.
+a background thread drains the rings into a chrome trace, which
+chrome://tracing and perfetto can open.
+
+link this file into the executable, and either set CONV_TRACE to
+the file to write, or call conv_trace_start and conv_trace_stop.
+*/
+
+#define RING_SIZE 65536  // events, a power of 2
+#define FLUSH_MS  10
+
+#define STR_(x) #x
+#define STR(x) STR_(x)
+
+typedef struct Event Event;
+struct Event {
+	unsigned long long tsc;
+	// the name, with the top bit set for exits
+	unsigned long long name;
+};
+
+typedef struct Ring Ring;
+struct Ring {
+	// head is only written by the thread, tail by the flusher
+	unsigned head;
+	unsigned tail;
+	unsigned dropped;
+	int tid;
+	Ring *next;
+	char pad[40];
+	Event events[RING_SIZE];
+};
+
+// the assembly below depends on these
+_Static_assert(offsetof(Ring, tail) == 4, "ring layout");
+_Static_assert(offsetof(Ring, dropped) == 8, "ring layout");
+_Static_assert(offsetof(Ring, events) == 64, "ring layout");
+_Static_assert(sizeof(Event) == 16, "event layout");
+
+__thread Ring *conv_ring __attribute__((tls_model("initial-exec")));
+
+Ring *rings;
+// the hooks return right away unless this is set
+volatile int conv_tracing;
+pthread_mutex_t rings_lock = PTHREAD_MUTEX_INITIALIZER;
+
+// called by the stubs the first time a thread crosses while tracing
+Ring *conv_trace_new_ring(void) {
+	Ring *ring = mmap(0, sizeof(Ring), PROT_READ | PROT_WRITE,
+		MAP_PRIVATE | MAP_ANONYMOUS | MAP_32BIT, -1, 0);
+	if (ring == MAP_FAILED)
+		abort();
+	ring->tid = syscall(SYS_gettid);
+	pthread_mutex_lock(&rings_lock);
+	ring->next = rings;
+	rings = ring;
+	pthread_mutex_unlock(&rings_lock);
+	conv_ring = ring;
+	return ring;
+}
+
+/*
+both hooks keep every register, the name is popped by the ret.
+while tracing is off they touch nothing else, so a program that
+links this file but never traces maps no rings. the slow path, which makes the thread's ring, saves all the
+argument registers too, as the stubs call the hooks with the
+arguments of the crossing call live.
+*/
+__asm__(
+	".globl __conv_trace_enter\n"
+	".globl __conv_trace_exit\n"
+	"__conv_trace_exit:\n"
+	"cmpl $0, conv_tracing(%rip)\n"
+	"je 5f\n"
+	"pushq %rax\n"
+	"xorl %eax, %eax\n"
+	"btsq $63, %rax\n"
+	"jmp 1f\n"
+	"__conv_trace_enter:\n"
+	"cmpl $0, conv_tracing(%rip)\n"
+	"je 5f\n"
+	"pushq %rax\n"
+	"xorl %eax, %eax\n"
+	"1:\n"
+	"pushq %rcx\n"
+	"pushq %rdx\n"
+	"pushq %rsi\n"
+	"orq 40(%rsp), %rax\n"
+	"movq %rax, %rsi\n"
+	"movq %fs:conv_ring@tpoff, %rcx\n"
+	"testq %rcx, %rcx\n"
+	"jz 4f\n"
+	"2:\n"
+	"movl (%rcx), %eax\n"
+	"movl %eax, %edx\n"
+	"subl 4(%rcx), %edx\n"
+	"cmpl $" STR(RING_SIZE) ", %edx\n"
+	"jae 3f\n"
+	"andl $" STR(RING_SIZE) " - 1, %eax\n"
+	"shll $4, %eax\n"
+	"movq %rsi, 72(%rcx, %rax)\n"
+	"leaq 64(%rcx, %rax), %rsi\n"
+	"rdtsc\n"
+	"shlq $32, %rdx\n"
+	"orq %rdx, %rax\n"
+	"movq %rax, (%rsi)\n"
+	"incl (%rcx)\n"
+	"popq %rsi\n"
+	"popq %rdx\n"
+	"popq %rcx\n"
+	"popq %rax\n"
+	"ret $8\n"
+	"3:\n"
+	"incl 8(%rcx)\n"
+	"popq %rsi\n"
+	"popq %rdx\n"
+	"popq %rcx\n"
+	"popq %rax\n"
+	"ret $8\n"
+	"4:\n"
+	"pushq %rbp\n"
+	"movq %rsp, %rbp\n"
+	"andq $-16, %rsp\n"
+	"subq $128, %rsp\n"
+	"movdqu %xmm0, 0(%rsp)\n"
+	"movdqu %xmm1, 16(%rsp)\n"
+	"movdqu %xmm2, 32(%rsp)\n"
+	"movdqu %xmm3, 48(%rsp)\n"
+	"movdqu %xmm4, 64(%rsp)\n"
+	"movdqu %xmm5, 80(%rsp)\n"
+	"movdqu %xmm6, 96(%rsp)\n"
+	"movdqu %xmm7, 112(%rsp)\n"
+	"pushq %rdi\n"
+	"pushq %rsi\n"
+	"pushq %r8\n"
+	"pushq %r9\n"
+	"pushq %r10\n"
+	"pushq %r11\n"
+	"call conv_trace_new_ring\n"
+	"popq %r11\n"
+	"popq %r10\n"
+	"popq %r9\n"
+	"popq %r8\n"
+	"popq %rsi\n"
+	"popq %rdi\n"
+	"movdqu 0(%rsp), %xmm0\n"
+	"movdqu 16(%rsp), %xmm1\n"
+	"movdqu 32(%rsp), %xmm2\n"
+	"movdqu 48(%rsp), %xmm3\n"
+	"movdqu 64(%rsp), %xmm4\n"
+	"movdqu 80(%rsp), %xmm5\n"
+	"movdqu 96(%rsp), %xmm6\n"
+	"movdqu 112(%rsp), %xmm7\n"
+	"movq %rbp, %rsp\n"
+	"popq %rbp\n"
+	"movq %rax, %rcx\n"
+	"jmp 2b\n"
+	"5:\n"
+	"ret $8\n"
+);
+
+FILE *trace_fp;
+pthread_t flusher;
+volatile int stopping;
+unsigned long long start_tsc;
+double us_per_tick;
+int first_event = 1;
+
+unsigned long long rdtsc(void) {
+	unsigned lo, hi;
+	__asm__ volatile ("rdtsc" : "=a"(lo), "=d"(hi));
+	return (unsigned long long) hi << 32 | lo;
+}
+
+double now_us(void) {
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1e6 + ts.tv_nsec / 1e3;
+}
+
+void drain(Ring *ring) {
+	unsigned head = __atomic_load_n(&ring->head, __ATOMIC_ACQUIRE);
+	unsigned tail = ring->tail;
+	for (; tail != head; tail++) {
+		Event *ev = &ring->events[tail % RING_SIZE];
+		char *name = (char *) (ev->name & ~(1ull << 63));
+		char *fn = strchr(name, ' ');
+		fprintf(trace_fp, "%s{\"name\":\"%s\",\"cat\":\"%.*s\",\"ph\":\"%c\","
+			"\"ts\":%.3f,\"pid\":%d,\"tid\":%d}",
+			first_event ? "" : ",\n", fn ? fn + 1 : name,
+			fn ? (int) (fn - name) : 0, name, ev->name >> 63 ? 'E' : 'B',
+			(ev->tsc - start_tsc) * us_per_tick, getpid(), ring->tid);
+		first_event = 0;
+	}
+	__atomic_store_n(&ring->tail, tail, __ATOMIC_RELEASE);
+}
+
+void drain_all(void) {
+	Ring *ring;
+	pthread_mutex_lock(&rings_lock);
+	for (ring = rings; ring; ring = ring->next)
+		drain(ring);
+	pthread_mutex_unlock(&rings_lock);
+	fflush(trace_fp);
+}
+
+void *flush_loop(void *arg) {
+	struct timespec ts = { 0, FLUSH_MS * 1000000 };
+	while (!stopping) {
+		nanosleep(&ts, 0);
+		drain_all();
+	}
+	return 0;
+}
+
+int conv_trace_start(char *path) {
+	struct timespec ts = { 0, 20 * 1000000 };
+	double t;
+
+	trace_fp = fopen(path, "w");
+	if (!trace_fp)
+		return 0;
+	// the rate of the tsc, measured against the monotonic clock
+	t = now_us();
+	start_tsc = rdtsc();
+	nanosleep(&ts, 0);
+	us_per_tick = (now_us() - t) / (rdtsc() - start_tsc);
+
+	fprintf(trace_fp, "{\"traceEvents\":[\n");
+	stopping = 0;
+	if (pthread_create(&flusher, 0, flush_loop, 0)) {
+		fclose(trace_fp);
+		trace_fp = 0;
+		return 0;
+	}
+	conv_tracing = 1;
+	return 1;
+}
+
+void conv_trace_stop(void) {
+	Ring *ring;
+	unsigned dropped = 0;
+
+	if (!trace_fp)
+		return;
+	conv_tracing = 0;
+	stopping = 1;
+	pthread_join(flusher, 0);
+	drain_all();
+	fprintf(trace_fp, "\n]}\n");
+	fclose(trace_fp);
+	trace_fp = 0;
+	pthread_mutex_lock(&rings_lock);
+	for (ring = rings; ring; ring = ring->next)
+		dropped += ring->dropped;
+	pthread_mutex_unlock(&rings_lock);
+	if (dropped)
+		fprintf(stderr, "conv trace: %u events dropped\n", dropped);
+}
+
+__attribute__((constructor))
+void conv_trace_init(void) {
+	char *path = getenv("CONV_TRACE");
+	if (path && conv_trace_start(path))
+		atexit(conv_trace_stop);
+}